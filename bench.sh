@@ -0,0 +1,62 @@
+#!/bin/bash
+
+# Side-by-side benchmark of the nasm backend (-c) and the C backend (-C),
+# then -c with and without cmov selects on random conditions.
+# Usage: ./bench.sh [lines] [runs] [iterations]
+
+BENCHDIR="bench/"
+LINES=${1:-20000}
+RUNS=${2:-200}
+ITERS=${3:-20000000}
+SRC=${BENCHDIR}digits.glmp
+SELECT_SRC=${BENCHDIR}select.glmp
+
+mkdir -p $BENCHDIR
+
+# Straight-line digit manipulation, the shape our generators emit
+awk -v n=$LINES 'BEGIN {
+    for (i = 0; i < n; i++)
+        print i * 7919 " dup 10 % swap 10 / 3 * + dup 100 % swap 4 / + 1 > drop"
+    print "0"
+}' > $SRC
+
+run() {
+    local bin=$1
+    local start=$(date +%s%N)
+    for ((r = 0; r < RUNS; r++)); do ./$bin > /dev/null; done
+    local end=$(date +%s%N)
+    echo "$bin: $(( (end - start) / RUNS / 1000 )) us/run"
+}
+
+if command -v nasm &> /dev/null; then
+    time ./build/glomp -c -o ${BENCHDIR}digits_asm $SRC
+    run ${BENCHDIR}digits_asm
+else
+    echo "nasm not found, skipping -c"
+fi
+
+time ./build/glomp -C -o ${BENCHDIR}digits_c $SRC
+run ${BENCHDIR}digits_c
+
+# Short pure if/else arms on an LCG bit, taken half the time at random
+cat > $SELECT_SRC <<EOF
+0 12345 0 while dup $ITERS < do
+    rot rot
+    6364136223846793005 * 1442695040888963407 +
+    dup 8589934592 / 2 %
+    rot swap
+    if 3 * 1 + else 2 + end
+    swap rot 1 +
+end drop drop out 10 put
+0
+EOF
+
+RUNS=5
+if command -v nasm &> /dev/null; then
+    ./build/glomp -c -o ${BENCHDIR}select_cmov $SELECT_SRC
+    ./build/glomp -c --no-cmov -o ${BENCHDIR}select_branch $SELECT_SRC
+    run ${BENCHDIR}select_cmov
+    run ${BENCHDIR}select_branch
+else
+    echo "nasm not found, skipping select"
+fi
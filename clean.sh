@@ -1,3 +1,3 @@
 #!/bin/bash
 
-bash -c "rm -f test/output/* test/results/*"
+bash -c "rm -f test/output/* test/output_c/* test/results/*"
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <string>
+#include "tokens.hpp"
+
+// .glmc - validated and linked program, ready to be mapped and interpreted
+//
+// layout: header | values[count] | locations[count] | strings[string_count] | types[count] | string data
+// every section starts on an 8 byte boundary, offsets are from the start of the file
+constexpr char glmc_magic[4] = {'G', 'L', 'M', 'C'};
+constexpr uint32_t glmc_version = 4;
+
+struct BytecodeHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t count;
+    uint64_t checksum;  // over everything following the header
+    uint64_t values_offset;
+    uint64_t locations_offset;
+    uint64_t types_offset;
+    uint64_t string_count;
+    uint64_t strings_offset;
+    uint64_t string_data_size;
+    uint64_t string_data_offset;
+};
+
+struct MappedBytecode {
+    void *addr = nullptr;
+    size_t length = 0;
+
+    MappedBytecode() = default;
+    MappedBytecode(const MappedBytecode&) = delete;
+    MappedBytecode &operator=(const MappedBytecode&) = delete;
+    ~MappedBytecode();
+
+    TokenView view() const;
+};
+
+bool isBytecodePath(const std::string &path);
+void writeBytecode(const TokenStream &tokens, std::string out_path);
+// false with error set when the file cannot be mapped or fails validation
+bool mapBytecode(std::string path, MappedBytecode &mapped, std::string &error);
@@ -1,7 +1,12 @@
 #pragma once
 
-#include <vector>
 #include <string>
 #include "tokens.hpp"
+#include "profile.hpp"
 
-void compile(const std::vector<Token> &tokens, std::string out_path, bool asmonly);
+// profile (optional) drives the layout of `if` blocks, branchless lowers
+// short pure if/else arms to cmov unless the profile shows a strong bias.
+// Arms the profile found unpredictable are lowered either way.
+void compile(const TokenStream &tokens, std::string out_path, bool asmonly, const BranchProfile *profile = nullptr,
+             bool branchless = true);
+void compileC(const TokenStream &tokens, std::string out_path, bool srconly);
@@ -1,6 +1,67 @@
 #pragma once
 
-#include <vector>
+#include <functional>
+#include <string>
 #include "tokens.hpp"
+#include "profile.hpp"
 
-int interpret(const std::vector<Token> &tokens);
+// data stack depth, the C backend gives its programs the same
+constexpr size_t data_stack_slots = size_t(1) << 20;
+// procedure call depth, shared by every backend
+constexpr size_t return_stack_slots = size_t(1) << 16;
+
+// mmap'd stack with a PROT_NONE guard page on each side
+struct DataStack {
+    uint64_t *base = nullptr;   // first slot
+    uint64_t *limit = nullptr;  // one past the last slot
+    void *mapping = nullptr;
+    size_t mapping_size = 0;
+};
+
+enum class RunStatus {
+    YIELDED,    // budget used up, call run() again to continue
+    HALTED,     // reached the end of the program, see returnValue()
+    FAILED      // runtime error, reported through the error callback
+};
+
+// A program in flight. All of its state - pc, both stacks - lives here, so
+// run() can stop after a budget of ops and pick up where it left off. One
+// thread can interleave any number of them. The tokens (and profile) are not
+// copied and must outlive the interpreter.
+class Interpreter {
+public:
+    using OutputFn = std::function<void(const char *data, size_t length)>;
+    using ErrorFn = std::function<void(const std::string &message)>;
+
+    Interpreter(const TokenView &tokens, OutputFn output, ErrorFn error, BranchProfile *profile = nullptr);
+    ~Interpreter();
+    Interpreter(const Interpreter&) = delete;
+    Interpreter &operator=(const Interpreter&) = delete;
+
+    // executes at most budget ops
+    RunStatus run(size_t budget);
+
+    RunStatus status() const { return state; }
+    int returnValue() const { return int(return_val); }
+
+private:
+    void fail(size_t ip, const char *what);
+    void dumpStack(const uint64_t *sp);
+
+    TokenView tokens;
+    OutputFn output;
+    ErrorFn error;
+    BranchProfile *profile;
+
+    DataStack stack;    // Program Stack
+    DataStack calls;    // return pcs of procedure calls
+    uint64_t *sp;       // next free slot
+    uint64_t *rp;
+    size_t pc = 0;
+    uint64_t return_val = 0;
+    RunStatus state = RunStatus::YIELDED;
+};
+
+// runs to completion, output to stdout, errors exit
+// counts the arms taken by every `if` into profile when given
+int interpret(const TokenView &tokens, BranchProfile *profile = nullptr);
@@ -1,8 +1,8 @@
 #pragma once
 
-#include <vector>
 #include <string>
 #include "tokens.hpp"
 
-std::vector<Token> tokenize(std::string str);
-void printTokens(const std::vector<Token> &toks);
+// false with error set on malformed source
+bool tokenize(const std::string &str, TokenStream &toks, std::string &error);
+void printTokens(const TokenStream &toks);
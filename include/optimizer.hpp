@@ -0,0 +1,15 @@
+#pragma once
+
+#include "tokens.hpp"
+
+struct InlineStats {
+    size_t calls_inlined = 0;
+    size_t procs_removed = 0;
+    size_t tokens_before = 0;
+    size_t tokens_after = 0;
+};
+
+// Replaces calls to small or single-use leaf procedures with their bodies and
+// drops the definitions nothing calls anymore. Runs on the unlinked stream,
+// anything malformed is left untouched for linkBlocks() to report.
+InlineStats inlineProcs(TokenStream &tokens);
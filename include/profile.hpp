@@ -0,0 +1,30 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "tokens.hpp"
+
+// how often each `if` took its then arm and its else arm, indexed by token index
+struct BranchCounts {
+    uint64_t then_count = 0;
+    uint64_t else_count = 0;
+};
+
+struct BranchProfile {
+    std::vector<BranchCounts> counts;
+
+    BranchProfile() = default;
+    explicit BranchProfile(size_t token_count) : counts(token_count) {}
+};
+
+// layout chosen for an `if` from its measured bias
+enum class BranchLayout {
+    DEFAULT,    // then arm falls through, else arm after it
+    COLD_THEN,  // then arm moved to the cold section
+    COLD_ELSE,  // else arm moved to the cold section
+    SELECT      // unpredictable, lower to cmov where the arms allow it
+};
+
+BranchLayout branchLayout(const BranchProfile *profile, size_t pc);
+void writeProfile(const BranchProfile &profile, std::string path);
+bool readProfile(std::string path, size_t token_count, BranchProfile &profile);
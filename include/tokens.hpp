@@ -1,8 +1,11 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
 #include <string>
+#include <vector>
 
-enum TokenType {
+enum TokenType : uint8_t {
     // Data Types
     _INT,   // integer
     _CHR,   // char
@@ -17,9 +20,9 @@ enum TokenType {
     _MOD,   // modulus (remainder of division)
 
     // Keywords
-//  _RET,   // returns
     _OUT,   // output integer to stdout
     _PUT,   // output char to stdout
+    _PUTS,  // output string (pointer, length) to stdout
     _DMP,   // dump stack
     _DUP,   // duplicate
     _DUP2,  // duplicate x2
@@ -30,6 +33,10 @@ enum TokenType {
     _IF,    // if condition
     _ELSE,  // else label
     _END,   // end of block
+    _WHILE, // loop head
+    _DO,    // loop condition check
+    _PROC,  // procedure definition
+    _RET,   // return, the `end` of a procedure after linking
     _GR,    // greater than
     _GE,    // greater equal
     _EQ,    // equal
@@ -44,10 +51,75 @@ enum TokenType {
     _COUNT
 };
 
-struct Token {
-    TokenType type = TokenType::_INV;
-    int line;
-    int column;
-    uint64_t value;
-    std::string as_string;
+// display names, indexed by TokenType
+inline constexpr const char *token_names[TokenType::_COUNT] = {
+    "INT", "CHR", "STR", "IDN",
+    "ADD", "SUB", "MUL", "DIV", "MOD",
+    "OUT", "PUT", "PUTS", "DMP", "DUP", "DUP2", "ROT", "SWP", "DROP",
+    "IF", "ELSE", "END", "WHILE", "DO", "PROC", "RET", "GR", "GE", "EQ", "LE", "LT", "NT",
+    "INV", "EOF"
+};
+
+inline const char *tokenName(TokenType type) {
+    return token_names[type];
+}
+
+struct Location {
+    uint32_t line;
+    uint32_t column;
+};
+
+// string literal, `_STR` tokens hold its index in the string table
+struct StringRef {
+    uint64_t offset;    // into the string data
+    uint64_t length;
+};
+
+// Struct of arrays - the hot fields (type, value) are kept apart from the
+// locations, which are only read for diagnostics
+struct TokenStream {
+    std::vector<TokenType> types;
+    std::vector<uint64_t> values;
+    std::vector<Location> locations;
+    std::vector<StringRef> strings;     // deduplicated string literals
+    std::string string_data;
+    std::vector<std::string> names;     // identifiers, `_IDN` tokens hold their index until linking
+
+    size_t size() const { return types.size(); }
+
+    // identifier of the `_IDN` token at pc, before linking
+    const std::string &name(size_t pc) const { return names[values[pc]]; }
+
+    void push(TokenType type, int line, int column, uint64_t value = 0) {
+        types.push_back(type);
+        values.push_back(value);
+        locations.push_back(Location{uint32_t(line), uint32_t(column)});
+    }
+
+    void reserve(size_t n) {
+        types.reserve(n);
+        values.reserve(n);
+        locations.reserve(n);
+    }
+};
+
+// Non-owning view over a token stream, either a TokenStream or a mapped .glmc file
+struct TokenView {
+    const TokenType *types;
+    const uint64_t *values;
+    const Location *locations;
+    size_t count;
+    const StringRef *strings;
+    const char *string_data;
+    size_t string_data_size;
+
+    TokenView(const TokenType *types, const uint64_t *values, const Location *locations, size_t count,
+              const StringRef *strings, const char *string_data, size_t string_data_size)
+        : types(types), values(values), locations(locations), count(count), strings(strings),
+          string_data(string_data), string_data_size(string_data_size) {}
+    TokenView(const TokenStream &ts)
+        : types(ts.types.data()), values(ts.values.data()), locations(ts.locations.data()), count(ts.size()),
+          strings(ts.strings.data()), string_data(ts.string_data.data()), string_data_size(ts.string_data.size()) {}
+
+    size_t size() const { return count; }
 };
@@ -2,14 +2,11 @@
 
 SRCDIR="test/src/"
 OUTDIR="test/output/"
+COUTDIR="test/output_c/"
 RESULTDIR="test/results/"
 
 # Compile tests
-for entry in ${SRCDIR}*.glmp
-do
-    filename=$(b=${entry##*/}; echo ${b%.*})
-    ./build/glomp -c -o $OUTDIR$filename $entry
-done
+./build/glomp -c -j$(nproc) --out-dir=$OUTDIR ${SRCDIR}*.glmp
 
 # Generate output from compiled tests and compare to previous output
 for entry in $OUTDIR*
@@ -26,6 +23,25 @@ do
     fi
 done
 
+# Compile tests through the C backend
+mkdir -p $COUTDIR
+./build/glomp -C -j$(nproc) --out-dir=$COUTDIR ${SRCDIR}*.glmp
+
+# Generate output from C compiled tests and compare to previous output
+for entry in $COUTDIR*
+do
+    name=$(b=${entry##*/}; echo ${b%.*})
+    bash -c "./$entry 2>&1 | tee ${RESULTDIR}${name}_ccom.txt &>/dev/null"
+    diff ${RESULTDIR}${name}.txt ${RESULTDIR}${name}_ccom.txt &>/dev/null
+    if [ $? -gt 0 ]; then
+        echo C compiler test failed: $name
+        echo expected:
+        echo `cat ${RESULTDIR}${name}.txt`
+        echo got:
+        echo `cat ${RESULTDIR}${name}_ccom.txt`
+    fi
+done
+
 # Generate output from interpreted tests and compare to previous output
 for entry in $SRCDIR*
 do
@@ -40,3 +56,20 @@ do
         echo `cat ${RESULTDIR}${name}_int.txt`
     fi
 done
+
+# Generate output from precompiled bytecode and compare to previous output
+for entry in ${SRCDIR}*.glmp
+do
+    name=$(b=${entry##*/}; echo ${b%.*})
+    ./build/glomp -b -o ${OUTDIR}${name}.glmc $entry
+    bash -c "./build/glomp -i ${OUTDIR}${name}.glmc 2>&1 | tee ${RESULTDIR}${name}_bc.txt &>/dev/null"
+    rm ${OUTDIR}${name}.glmc
+    diff ${RESULTDIR}${name}.txt ${RESULTDIR}${name}_bc.txt &>/dev/null
+    if [ $? -gt 0 ]; then
+        echo Bytecode test failed: $name
+        echo expected:
+        echo `cat ${RESULTDIR}${name}.txt`
+        echo got:
+        echo `cat ${RESULTDIR}${name}_bc.txt`
+    fi
+done
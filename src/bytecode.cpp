@@ -0,0 +1,140 @@
+#include "bytecode.hpp"
+
+extern "C" {
+    #include <fcntl.h>      // for open
+    #include <unistd.h>     // for close
+    #include <sys/mman.h>   // for mmap
+    #include <sys/stat.h>   // for fstat
+}
+#include <cstring>
+#include <iostream>
+#include <fstream>
+
+size_t align8(size_t n) {
+    return (n + 7) & ~size_t(7);
+}
+
+// FNV-1a over 64-bit words, every section is padded to a whole word
+uint64_t checksum(const unsigned char *data, size_t len) {
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i + 8 <= len; i += 8) {
+        uint64_t w;
+        std::memcpy(&w, data + i, 8);
+        h ^= w;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+bool isBytecodePath(const std::string &path) {
+    const std::string ext = ".glmc";
+    return path.size() > ext.size() && path.compare(path.size() - ext.size(), ext.size(), ext) == 0;
+}
+
+void writeBytecode(const TokenStream &tokens, std::string out_path) {
+    const size_t count = tokens.size();
+
+    BytecodeHeader header;
+    std::memcpy(header.magic, glmc_magic, sizeof(glmc_magic));
+    header.version = glmc_version;
+    header.count = count;
+    header.values_offset = align8(sizeof(BytecodeHeader));
+    header.locations_offset = header.values_offset + count * sizeof(uint64_t);
+    header.string_count = tokens.strings.size();
+    header.strings_offset = header.locations_offset + count * sizeof(Location);
+    header.types_offset = header.strings_offset + header.string_count * sizeof(StringRef);
+    header.string_data_size = tokens.string_data.size();
+    header.string_data_offset = align8(header.types_offset + count * sizeof(TokenType));
+    const size_t length = align8(header.string_data_offset + header.string_data_size);
+
+    std::vector<unsigned char> body(length - header.values_offset, 0);
+    auto section = [&](uint64_t offset, const void *data, size_t size) {
+        if (size) std::memcpy(body.data() + offset - header.values_offset, data, size);
+    };
+    section(header.values_offset, tokens.values.data(), count * sizeof(uint64_t));
+    section(header.locations_offset, tokens.locations.data(), count * sizeof(Location));
+    section(header.strings_offset, tokens.strings.data(), header.string_count * sizeof(StringRef));
+    section(header.types_offset, tokens.types.data(), count * sizeof(TokenType));
+    section(header.string_data_offset, tokens.string_data.data(), header.string_data_size);
+    header.checksum = checksum(body.data(), body.size());
+
+    std::ofstream out_file(out_path, std::ofstream::trunc | std::ofstream::out | std::ofstream::binary);
+    if (!out_file.is_open()) {
+        std::cerr << "unable to create file: " << out_path << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    out_file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out_file.write(reinterpret_cast<const char*>(body.data()), body.size());
+    if (!out_file) {
+        std::cerr << "failed writing: " << out_path << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+bool mapBytecode(std::string path, MappedBytecode &mapped, std::string &error) {
+    auto fail = [&](std::string msg) {
+        error = msg;
+        return false;
+    };
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return fail("failed to open file");
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return fail("failed to stat file");
+    }
+    size_t length = size_t(st.st_size);
+    if (length < sizeof(BytecodeHeader)) {
+        close(fd);
+        return fail("not a glomp bytecode file");
+    }
+
+    void *addr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) return fail("mmap failed");
+    mapped.addr = addr;
+    mapped.length = length;
+
+    const BytecodeHeader *header = static_cast<const BytecodeHeader*>(addr);
+    if (std::memcmp(header->magic, glmc_magic, sizeof(glmc_magic)) != 0) return fail("not a glomp bytecode file");
+    if (header->version != glmc_version)
+        return fail("bytecode version " + std::to_string(header->version) + " is not supported (expected " + std::to_string(glmc_version) + ")");
+
+    const uint64_t count = header->count;
+    if (header->values_offset != align8(sizeof(BytecodeHeader))
+     || header->locations_offset != header->values_offset + count * sizeof(uint64_t)
+     || header->strings_offset != header->locations_offset + count * sizeof(Location)
+     || header->types_offset != header->strings_offset + header->string_count * sizeof(StringRef)
+     || header->string_data_offset != align8(header->types_offset + count * sizeof(TokenType))
+     || align8(header->string_data_offset + header->string_data_size) != length) return fail("corrupt bytecode header");
+
+    const unsigned char *base = static_cast<const unsigned char*>(addr);
+    if (checksum(base + header->values_offset, length - header->values_offset) != header->checksum) return fail("checksum mismatch");
+
+    const TokenType *types = reinterpret_cast<const TokenType*>(base + header->types_offset);
+    if (count == 0 || types[count - 1] != TokenType::_EOF) return fail("corrupt bytecode, missing EOF");
+
+    const StringRef *strings = reinterpret_cast<const StringRef*>(base + header->strings_offset);
+    for (uint64_t i = 0; i < header->string_count; ++i) {
+        if (strings[i].offset + strings[i].length > header->string_data_size) return fail("corrupt bytecode, string out of range");
+    }
+    return true;
+}
+
+MappedBytecode::~MappedBytecode() {
+    if (addr) munmap(addr, length);
+}
+
+TokenView MappedBytecode::view() const {
+    const unsigned char *base = static_cast<const unsigned char*>(addr);
+    const BytecodeHeader *header = static_cast<const BytecodeHeader*>(addr);
+    return TokenView(reinterpret_cast<const TokenType*>(base + header->types_offset),
+                     reinterpret_cast<const uint64_t*>(base + header->values_offset),
+                     reinterpret_cast<const Location*>(base + header->locations_offset),
+                     size_t(header->count),
+                     reinterpret_cast<const StringRef*>(base + header->strings_offset),
+                     reinterpret_cast<const char*>(base + header->string_data_offset),
+                     size_t(header->string_data_size));
+}
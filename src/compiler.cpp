@@ -1,50 +1,468 @@
 #include "compiler.hpp"
+#include "interpreter.hpp" // for data_stack_slots, return_stack_slots
 
 extern "C" {
-    #include <unistd.h> // for execl
+    #include <fcntl.h> // for O_CLOEXEC
+    #include <signal.h> // for signal
+    #include <unistd.h> // for execvp
+    #include <sys/mman.h> // for memfd_create
     #include <sys/wait.h> // for waitpid
 }
 #include <cassert>
+#include <cerrno>
 #include <cstdio> // For std::remove
+#include <cstring>
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <deque>
 #include <algorithm>
 #include <filesystem>
 namespace fs = std::filesystem;
 
-void writeline(std::ofstream &ofs, std::string str) {
-    ofs << str << "\n";
+void writeline(std::ostream &os, std::string str) {
+    os << str << "\n";
 }
 
-int call_nasm_ld(std::string out_path) {
-    std::string asmfile = out_path + ".asm";
-    std::string objfile = out_path + ".o";
-    
-    std::string nasmcmd = "nasm -felf64 " + asmfile + " -o " + objfile;
-    std::string ldcmd = "ld " + objfile + " -o " + out_path;
-    std::string rmcmd = "rm " + objfile + " " + asmfile;
-    std::string cmd = nasmcmd + " && " + ldcmd + " && " + rmcmd;
+// std::streambuf writing straight to a file descriptor (pipe or memfd)
+struct FdBuf : public std::streambuf {
+    int fd = -1;
+    char buf[1 << 16];
+
+    void open(int new_fd) {
+        fd = new_fd;
+        setp(buf, buf + sizeof(buf));
+    }
+
+    bool close() {
+        bool ok = flushBuffer();
+        if (::close(fd) != 0) ok = false;
+        fd = -1;
+        return ok;
+    }
+
+    int overflow(int c) override {
+        if (!flushBuffer()) return traits_type::eof();
+        if (c != traits_type::eof()) {
+            *pptr() = char(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    int sync() override {
+        return flushBuffer() ? 0 : -1;
+    }
+
+    bool flushBuffer() {
+        char *p = pbase();
+        while (p < pptr()) {
+            ssize_t n = write(fd, p, size_t(pptr() - p));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            p += n;
+        }
+        setp(buf, buf + sizeof(buf));
+        return true;
+    }
+};
+
+// fork and exec args, stdin_fd becomes the child's stdin when given
+pid_t spawn(const std::vector<std::string> &args, int stdin_fd = -1) {
+    std::vector<char*> argv;
+    for (const auto &arg : args) argv.push_back(const_cast<char*>(arg.c_str()));
+    argv.push_back(nullptr);
 
-    int pid;
+    pid_t pid = fork();
+    if (pid < 0) {
+        std::cerr << "unable to start " << args[0] << ": " << std::strerror(errno) << std::endl;
+        return -1;
+    }
+    if (pid == 0) {
+        if (stdin_fd >= 0) dup2(stdin_fd, STDIN_FILENO);
+        execvp(argv[0], argv.data());
+        std::cerr << "unable to run " << args[0] << ": " << std::strerror(errno) << std::endl;
+        _exit(127);
+    }
+    return pid;
+}
+
+// wait for a child started by spawn(), reports how it failed
+bool waitChild(pid_t pid, std::string name) {
+    if (pid < 0) return false;
     int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            std::cerr << "unable to wait for " << name << ": " << std::strerror(errno) << std::endl;
+            return false;
+        }
+    }
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) return true;
+    if (WIFEXITED(status)) std::cerr << "error: " << name << " exited with status " << WEXITSTATUS(status) << std::endl;
+    else if (WIFSIGNALED(status)) std::cerr << "error: " << name << " killed by signal " << WTERMSIG(status) << std::endl;
+    return false;
+}
 
-    if ((pid = fork())) {
-        //parent, wait
-        waitpid(pid, &status, 0);
-    } else {
-        execl("/bin/bash", "bash", "-c", cmd.c_str(), (char*)NULL);
+// nasm re-reads its input on every pass so it cannot take a pipe, the asm is
+// handed over in a memfd instead. The object reaches ld the same way, only the
+// executable touches the filesystem.
+bool call_nasm_ld(int asm_fd, std::string out_path) {
+    int obj_fd = memfd_create("glomp.o", 0);
+    if (obj_fd < 0) {
+        std::cerr << "unable to create object memfd: " << std::strerror(errno) << std::endl;
+        return false;
     }
-    return status;
+    std::string asmfile = "/dev/fd/" + std::to_string(asm_fd);
+    std::string objfile = "/dev/fd/" + std::to_string(obj_fd);
+
+    bool ok = waitChild(spawn({"nasm", "-felf64", asmfile, "-o", objfile}), "nasm")
+           && waitChild(spawn({"ld", objfile, "-o", out_path}), "ld");
+    close(obj_fd);
+    return ok;
 }
 
-void compile(const std::vector<Token> &tokens, std::string out_path, bool asmonly) {  
-    assert((TokenType::_COUNT == 28) && "Exhaustive handling of tokens in compile()");
-    std::ofstream out_file(out_path + ".asm", std::ofstream::trunc | std::ofstream::out);
+bool isPow2(uint64_t v) {
+    return v && !(v & (v - 1));
+}
 
-    if (!out_file.is_open()) {
-        std::cerr << "unable to create file: " << out_path << std::endl;
-        exit(EXIT_FAILURE);
+int log2Floor(uint64_t v) {
+    int l = 0;
+    while (v >>= 1) ++l;
+    return l;
+}
+
+// immediates of 64-bit instructions are sign extended 32-bit values
+bool fitsImm32(uint64_t v) {
+    return v <= 0x7fffffff;
+}
+
+// Magic number for unsigned division by a constant: n / d == mulhi(n, magic) >> shift.
+// When no 64-bit magic exists `add` is set and the quotient needs the
+// ((n - t) >> 1) + t fixup before shifting by shift - 1.
+struct DivMagic {
+    uint64_t magic;
+    int shift;
+    bool add;
+};
+
+DivMagic divMagic(uint64_t d) {
+    using u128 = unsigned __int128;
+    int l = log2Floor(d - 1) + 1; // ceil(log2(d)), d is not a power of two and d < 2^63
+    for (int p = 64; p <= 64 + l; ++p) {
+        u128 two_p = u128(1) << p;
+        u128 m = (two_p + d - 1) / d;
+        if ((m >> 64) == 0 && m * d - two_p <= (u128(1) << (p - 64)))
+            return DivMagic{uint64_t(m), p - 64, false};
+    }
+    u128 m = ((u128(1) << (64 + l)) + d - 1) / d;
+    return DivMagic{uint64_t(m - (u128(1) << 64)), l, true};
+}
+
+// Multiply rax by a constant, result in rax
+void emitConstMul(std::ostream &out_file, uint64_t k) {
+    if (k == 0) {
+        writeline(out_file, "    xor    eax, eax");
+        return;
+    }
+    if (k == 1) return;
+    int tz = 0;
+    uint64_t odd = k;
+    while (!(odd & 1)) { odd >>= 1; ++tz; }
+    if (odd == 1 || odd == 3 || odd == 5 || odd == 9) {
+        if (odd != 1) writeline(out_file, "    lea    rax, [rax+rax*" + std::to_string(odd - 1) + "]");
+        if (tz) writeline(out_file, "    shl    rax, " + std::to_string(tz));
+    }
+    else if (fitsImm32(k)) {
+        writeline(out_file, "    imul   rax, rax, " + std::to_string(k));
+    }
+    else {
+        writeline(out_file, "    mov    rcx, " + std::to_string(k));
+        writeline(out_file, "    imul   rax, rcx");
+    }
+}
+
+// Divide (or take the remainder of) rax by a non-zero constant, clobbers rcx and rdx
+void emitConstDivModRax(std::ostream &out_file, uint64_t d, bool mod) {
+    if (d == 1 && !mod) return;
+    if (d == 1) {
+        writeline(out_file, "    xor    eax, eax");
+    }
+    else if (isPow2(d)) {
+        if (mod && fitsImm32(d - 1)) {
+            writeline(out_file, "    and    rax, " + std::to_string(d - 1));
+        }
+        else if (mod) {
+            writeline(out_file, "    mov    rcx, " + std::to_string(d - 1));
+            writeline(out_file, "    and    rax, rcx");
+        }
+        else writeline(out_file, "    shr    rax, " + std::to_string(log2Floor(d)));
+    }
+    else {
+        // quotient into rax, dividend kept in rcx for the remainder
+        writeline(out_file, "    mov    rcx, rax");
+        if (d > (uint64_t(1) << 63)) {
+            writeline(out_file, "    mov    rdx, " + std::to_string(d));
+            writeline(out_file, "    xor    eax, eax");
+            writeline(out_file, "    cmp    rcx, rdx");
+            writeline(out_file, "    setae  al");
+        }
+        else {
+            DivMagic dm = divMagic(d);
+            writeline(out_file, "    mov    rdx, " + std::to_string(dm.magic));
+            writeline(out_file, "    mul    rdx");
+            if (dm.add) {
+                writeline(out_file, "    mov    rax, rcx");
+                writeline(out_file, "    sub    rax, rdx");
+                writeline(out_file, "    shr    rax, 1");
+                writeline(out_file, "    add    rax, rdx");
+                if (dm.shift > 1) writeline(out_file, "    shr    rax, " + std::to_string(dm.shift - 1));
+            }
+            else {
+                writeline(out_file, "    mov    rax, rdx");
+                if (dm.shift) writeline(out_file, "    shr    rax, " + std::to_string(dm.shift));
+            }
+        }
+        if (mod) {
+            if (fitsImm32(d)) writeline(out_file, "    imul   rax, rax, " + std::to_string(d));
+            else {
+                writeline(out_file, "    mov    rdx, " + std::to_string(d));
+                writeline(out_file, "    imul   rax, rdx");
+            }
+            writeline(out_file, "    sub    rcx, rax");
+            writeline(out_file, "    mov    rax, rcx");
+        }
+    }
+}
+
+// Divide (or take the remainder of) the top of the stack by a non-zero constant
+void emitConstDivMod(std::ostream &out_file, uint64_t d, bool mod) {
+    if (d == 1 && !mod) return;
+    writeline(out_file, "    pop    rax");
+    emitConstDivModRax(out_file, d, mod);
+    writeline(out_file, "    push   rax");
+}
+
+// condition code suffix for setcc/jcc, comparisons are unsigned
+std::string conditionCode(TokenType type) {
+    switch (type) {
+        case TokenType::_GR: return "a";
+        case TokenType::_GE: return "ae";
+        case TokenType::_EQ: return "e";
+        case TokenType::_LE: return "be";
+        case TokenType::_LT: return "b";
+        case TokenType::_NT: return "ne";
+        default:
+            std::cerr << "unreachable - conditionCode()" << std::endl;
+            exit(EXIT_FAILURE);
+    }
+}
+
+// arms longer than this keep their branches, both arms always execute
+constexpr size_t select_max_arm = 8;
+// stack slots below the condition the arms may read
+constexpr int select_max_inputs = 4;
+// the condition and values of a select live in these, rax, rcx and rdx are scratch
+const char *const select_regs[] = {"rsi", "rdi", "r8", "r9", "r10", "r11", "rbx", "r12", "r13", "r14"};
+
+// net stack effect of an op without side effects, false for anything else.
+// `/` and `%` only qualify right after a non-zero literal, see emitSelect().
+bool pureStackEffect(TokenType type, int &pops, int &pushes) {
+    switch (type) {
+        case TokenType::_INT:
+        case TokenType::_CHR:  pops = 0; pushes = 1; return true;
+        case TokenType::_ADD:
+        case TokenType::_SUB:
+        case TokenType::_MUL:
+        case TokenType::_GR:
+        case TokenType::_GE:
+        case TokenType::_EQ:
+        case TokenType::_LE:
+        case TokenType::_LT:
+        case TokenType::_NT:   pops = 2; pushes = 1; return true;
+        case TokenType::_DUP:  pops = 1; pushes = 2; return true;
+        case TokenType::_DUP2: pops = 2; pushes = 4; return true;
+        case TokenType::_SWP:  pops = 2; pushes = 2; return true;
+        case TokenType::_ROT:  pops = 3; pushes = 3; return true;
+        case TokenType::_DROP: pops = 1; pushes = 0; return true;
+        default: return false;
+    }
+}
+
+// A value while lowering a select: a constant or a register.
+struct SelectValue {
+    bool imm;
+    uint64_t value;
+    int reg;
+
+    std::string text() const { return imm ? std::to_string(value) : select_regs[reg]; }
+    bool operator==(const SelectValue &o) const { return imm == o.imm && (imm ? value == o.value : reg == o.reg); }
+};
+
+// Lowers `if <then> else <else> end` without branches when both arms are
+// short, free of side effects (division only by a non-zero literal, which
+// cannot trap) and leave the same number of values: the
+// inputs are popped into registers, both arms are evaluated (stack shuffles
+// only rename, constants fold) and every output slot is picked with cmov.
+// Writes nothing and returns false when the block does not qualify.
+bool emitSelect(std::ostream &out_file, const TokenStream &tokens, size_t if_pc, size_t else_pc, size_t end_pc) {
+    struct Arm {
+        size_t begin, end;
+        int inputs = 0, effect = 0;
+    };
+    Arm arms[2] = {{if_pc + 1, else_pc ? else_pc : end_pc}, {else_pc ? else_pc + 1 : end_pc, end_pc}};
+    for (Arm &arm : arms) {
+        if (arm.end - arm.begin > select_max_arm) return false;
+        int height = 0;
+        for (size_t pc = arm.begin; pc < arm.end; ++pc) {
+            int pops, pushes;
+            const TokenType type = tokens.types[pc];
+            if (type == TokenType::_DIV || type == TokenType::_MOD) {
+                const bool literal = pc > arm.begin && tokens.values[pc - 1] != 0
+                                  && (tokens.types[pc - 1] == TokenType::_INT || tokens.types[pc - 1] == TokenType::_CHR);
+                if (!literal) return false;
+                pops = 2;
+                pushes = 1;
+            }
+            else if (!pureStackEffect(type, pops, pushes)) return false;
+            height -= pops;
+            arm.inputs = std::max(arm.inputs, -height);
+            height += pushes;
+        }
+        arm.effect = height;
+    }
+    if (arms[0].effect != arms[1].effect) return false;
+    const int inputs = std::max(arms[0].inputs, arms[1].inputs);
+    if (inputs > select_max_inputs) return false;
+
+    std::ostringstream out;
+    int next_reg = 0;
+    const int reg_count = int(sizeof(select_regs) / sizeof(select_regs[0]));
+
+    writeline(out, ";; ~~~~~  if select ~~~~~ ;;");
+    const SelectValue cond{false, 0, next_reg++};
+    writeline(out, "    pop     " + cond.text());
+    std::vector<SelectValue> in(inputs);
+    for (int i = inputs - 1; i >= 0; --i) {
+        in[i] = SelectValue{false, 0, next_reg++};
+        writeline(out, "    pop     " + in[i].text());
+    }
+
+    // operand b of a binary op as an instruction operand, large constants go through rdx
+    auto source = [&](const SelectValue &v) {
+        if (!v.imm || fitsImm32(v.value)) return v.text();
+        writeline(out, "    mov     rdx, " + v.text());
+        return std::string("rdx");
+    };
+
+    std::vector<SelectValue> results[2];
+    for (int a = 0; a < 2; ++a) {
+        std::vector<SelectValue> &stack = results[a];
+        stack = in;
+        for (size_t pc = arms[a].begin; pc < arms[a].end; ++pc) {
+            const TokenType type = tokens.types[pc];
+            const size_t n = stack.size();
+            switch (type) {
+                case TokenType::_INT:
+                case TokenType::_CHR:
+                    stack.push_back(SelectValue{true, tokens.values[pc], -1});
+                break;
+                case TokenType::_DUP:  stack.push_back(stack[n - 1]); break;
+                case TokenType::_DUP2: stack.push_back(stack[n - 2]); stack.push_back(stack[n - 1]); break;
+                case TokenType::_SWP:  std::swap(stack[n - 2], stack[n - 1]); break;
+                case TokenType::_ROT:  std::rotate(stack.end() - 3, stack.end() - 2, stack.end()); break;
+                case TokenType::_DROP: stack.pop_back(); break;
+                default: {
+                    const SelectValue b = stack[n - 1];
+                    const SelectValue lhs = stack[n - 2];
+                    stack.resize(n - 2);
+                    if (lhs.imm && b.imm) {
+                        uint64_t v = 0;
+                        switch (type) {
+                            case TokenType::_ADD: v = lhs.value + b.value; break;
+                            case TokenType::_SUB: v = lhs.value - b.value; break;
+                            case TokenType::_MUL: v = lhs.value * b.value; break;
+                            case TokenType::_DIV: v = lhs.value / b.value; break;
+                            case TokenType::_MOD: v = lhs.value % b.value; break;
+                            case TokenType::_GR:  v = lhs.value > b.value; break;
+                            case TokenType::_GE:  v = lhs.value >= b.value; break;
+                            case TokenType::_EQ:  v = lhs.value == b.value; break;
+                            case TokenType::_LE:  v = lhs.value <= b.value; break;
+                            case TokenType::_LT:  v = lhs.value < b.value; break;
+                            default:              v = lhs.value != b.value; break;
+                        }
+                        stack.push_back(SelectValue{true, v, -1});
+                        break;
+                    }
+                    if (next_reg == reg_count) return false;
+                    const SelectValue dst{false, 0, next_reg++};
+                    if (type == TokenType::_DIV || type == TokenType::_MOD) {
+                        // b is the non-zero literal the arm scan required
+                        writeline(out, "    mov     rax, " + lhs.text());
+                        emitConstDivModRax(out, b.value, type == TokenType::_MOD);
+                        writeline(out, "    mov     " + dst.text() + ", rax");
+                    }
+                    else if (type == TokenType::_ADD || type == TokenType::_SUB || type == TokenType::_MUL) {
+                        static const char *const ops[] = {"add ", "sub ", "imul"};
+                        writeline(out, "    mov     " + dst.text() + ", " + lhs.text());
+                        writeline(out, std::string("    ") + ops[type == TokenType::_ADD ? 0 : type == TokenType::_SUB ? 1 : 2]
+                                       + "    " + dst.text() + ", " + source(b));
+                    }
+                    else {
+                        if (lhs.imm) writeline(out, "    mov     rax, " + lhs.text());
+                        writeline(out, "    cmp     " + (lhs.imm ? std::string("rax") : lhs.text()) + ", " + source(b));
+                        writeline(out, "    set" + conditionCode(type) + "    al");
+                        writeline(out, "    movzx   " + dst.text() + ", al");
+                    }
+                    stack.push_back(dst);
+                } break;
+            }
+        }
+    }
+
+    // cmov only takes a register source, constants the then arm leaves need one
+    std::vector<SelectValue> &then_out = results[0];
+    const std::vector<SelectValue> &else_out = results[1];
+    for (size_t i = 0; i < then_out.size(); ++i) {
+        if (!then_out[i].imm || then_out[i] == else_out[i]) continue;
+        if (next_reg == reg_count) return false;
+        SelectValue reg{false, 0, next_reg++};
+        writeline(out, "    mov     " + reg.text() + ", " + then_out[i].text());
+        then_out[i] = reg;
+    }
+
+    writeline(out, "    test    " + cond.text() + ", " + cond.text());
+    for (size_t i = 0; i < then_out.size(); ++i) {
+        // mov and push leave the flags alone
+        writeline(out, "    mov     rax, " + else_out[i].text());
+        if (!(then_out[i] == else_out[i])) writeline(out, "    cmovnz  rax, " + then_out[i].text());
+        writeline(out, "    push    rax");
+    }
+
+    out_file << out.str();
+    return true;
+}
+
+void compile(const TokenStream &tokens, std::string out_path, bool asmonly, const BranchProfile *profile, bool branchless) {
+    assert((TokenType::_COUNT == 33) && "Exhaustive handling of tokens in compile()");
+    // -a writes <out>.asm, otherwise the asm only ever lives in a memfd
+    std::filebuf file_buf;
+    FdBuf fd_buf;
+    if (asmonly) {
+        if (!file_buf.open(out_path + ".asm", std::ios::out | std::ios::trunc)) {
+            std::cerr << "unable to create file: " << out_path << std::endl;
+            exit(EXIT_FAILURE);
+        }
     }
+    else {
+        int asm_fd = memfd_create("glomp.asm", 0);
+        if (asm_fd < 0) {
+            std::cerr << "unable to create asm memfd: " << std::strerror(errno) << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        fd_buf.open(asm_fd);
+    }
+    std::ostream out_file(asmonly ? static_cast<std::streambuf*>(&file_buf) : &fd_buf);
+
     writeline(out_file, "BITS 64\n");
     writeline(out_file, "segment .text\n");
     // `out` subroutine - prints uint64_t to stdout
@@ -89,7 +507,7 @@ void compile(const std::vector<Token> &tokens, std::string out_path, bool asmonl
     writeline(out_file, "    ret\n");
 
     // only generate dumpstack if it is called
-    bool dump_called = std::find_if(std::begin(tokens), std::end(tokens), [](const Token& t) { return t.type == TokenType::_DMP; }) != tokens.end();
+    bool dump_called = std::find(tokens.types.begin(), tokens.types.end(), TokenType::_DMP) != tokens.types.end();
     if (dump_called) {
 writeline(out_file, R"(glomp_dumpstack:
     mov     rax, 1
@@ -124,173 +542,317 @@ glomp_dumpstackdone:
     ret)");
     }
 
+    // procedure calls keep their return addresses on a separate stack, swapped in through r15
+    bool has_procs = std::find(tokens.types.begin(), tokens.types.end(), TokenType::_PROC) != tokens.types.end();
+    if (has_procs) {
+        // a call with no room left for its return address ends the program, as the interpreter does
+writeline(out_file, R"(
+glomp_call_overflow:
+    mov     rax, 1
+    mov     rdi, 2
+    mov     rsi, glomp_overflowstr
+    mov     rdx, 36
+    syscall
+    mov     rax, 60
+    mov     rdi, 1
+    syscall)");
+    }
+
     // entry point
     writeline(out_file, "\nglobal _start");
     writeline(out_file, "_start:");
     writeline(out_file, "; store pointer of bottom of stack in rbp");
     writeline(out_file, "    mov     rbp, rsp");
+    if (has_procs) writeline(out_file, "    mov     r15, glomp_ret_stack + 8*" + std::to_string(return_stack_slots));
 
     auto quit = [&](std::string msg) {
-        out_file.close();
-        out_path += ".asm";
-        int result = std::remove(out_path.c_str());
-        if (result) std::cerr << "unable to delete: " << out_path << std::endl;
+        if (asmonly) {
+            file_buf.close();
+            out_path += ".asm";
+            int result = std::remove(out_path.c_str());
+            if (result) std::cerr << "unable to delete: " << out_path << std::endl;
+        }
         std::cerr << msg << std::endl;
         exit(EXIT_FAILURE);
     };
     
+    std::ostream *out = &out_file;            // loop conditions and cold arms are captured and emitted elsewhere
+    std::deque<std::ostringstream> captures;  // code being captured, innermost last
+    std::vector<size_t> loop_heads;           // `while` of the conditions being captured
+    std::vector<std::string> loop_tests;      // condition and back edge of the open loop bodies
+    std::string loop_jcc;                     // set when a condition ends in a comparison
+    std::vector<std::pair<size_t, size_t>> cold_arms;  // token closing a captured cold arm, `end` of its block
+    std::vector<size_t> cold_elses;           // `else` tokens starting a cold arm
+    std::string cold_text;                    // cold arms, emitted after the program
+
+    auto beginCapture = [&]() {
+        captures.emplace_back();
+        out = &captures.back();
+    };
+    auto endCapture = [&]() {
+        std::string code = captures.back().str();
+        captures.pop_back();
+        out = captures.empty() ? static_cast<std::ostream*>(&out_file) : &captures.back();
+        return code;
+    };
+    auto endColdArm = [&]() {
+        cold_text += endCapture();
+        cold_text += "    jmp     glomp_end_" + std::to_string(cold_arms.back().second) + "\n";
+        cold_arms.pop_back();
+    };
+
     for (size_t pc = 0; pc < tokens.size(); ++pc) {
-        const Token &t = tokens[pc];
+        const uint64_t value = tokens.values[pc];
 
-        switch (t.type) {
+        switch (tokens.types[pc]) {
         case TokenType::_INT:
-        case TokenType::_CHR:
-            writeline(out_file, "    push    " + std::to_string(t.value));
-        break;
+        case TokenType::_CHR: {
+            // constant operand of a following `*`, `/` or `%` - reduce instead of push
+            TokenType next = tokens.types[pc + 1];
+            if (next == TokenType::_MUL) {
+                if (value != 1) {
+                    writeline(*out, "    pop    rax");
+                    emitConstMul(*out, value);
+                    writeline(*out, "    push   rax");
+                }
+                ++pc;
+            }
+            else if ((next == TokenType::_DIV || next == TokenType::_MOD) && value != 0) {
+                emitConstDivMod(*out, value, next == TokenType::_MOD);
+                ++pc;
+            }
+            else if (next == TokenType::_MOD) {
+                // modulo by zero leaves the dividend untouched
+                ++pc;
+            }
+            else if (fitsImm32(value)) writeline(*out, "    push    " + std::to_string(value));
+            else {
+                // push only takes a sign extended 32-bit immediate
+                writeline(*out, "    mov     rax, " + std::to_string(value));
+                writeline(*out, "    push    rax");
+            }
+        } break;
         case TokenType::_STR:
-            quit("_STR NYI");
+            writeline(*out, "    mov    rax, glomp_str_" + std::to_string(value));
+            writeline(*out, "    push   rax");
+            writeline(*out, "    push   " + std::to_string(tokens.strings[value].length));
         break;
         case TokenType::_IDN:
-            quit("_IDN NYI");
+            // rsp is the data stack, the return address goes on the call stack in r15
+            writeline(*out, "    mov     rax, glomp_ret_stack");
+            writeline(*out, "    cmp     r15, rax");
+            writeline(*out, "    jbe     glomp_call_overflow");
+            writeline(*out, "    xchg    rsp, r15");
+            writeline(*out, "    call    glomp_proc_" + std::to_string(value));
+            writeline(*out, "    xchg    rsp, r15");
+        break;
+        case TokenType::_PROC:
+            writeline(*out, ";; ~~~~~ proc " + tokens.name(pc + 1) + " ~~~~~ ;;");
+            writeline(*out, "    jmp     glomp_end_" + std::to_string(value));
+            writeline(*out, "glomp_proc_" + std::to_string(pc) + ":");
+            writeline(*out, "    xchg    rsp, r15");
+            ++pc; // name
+        break;
+        case TokenType::_RET:
+            writeline(*out, "    xchg    rsp, r15");
+            writeline(*out, "    ret");
+            writeline(*out, "glomp_end_" + std::to_string(pc) + ":");
         break;
         case TokenType::_ADD:
-            writeline(out_file, "    pop    rcx");
-            writeline(out_file, "    pop    rax");
-            writeline(out_file, "    add    rax, rcx");
-            writeline(out_file, "    push   rax");
+            writeline(*out, "    pop    rcx");
+            writeline(*out, "    pop    rax");
+            writeline(*out, "    add    rax, rcx");
+            writeline(*out, "    push   rax");
         break;
         case TokenType::_SUB:
-            writeline(out_file, "    pop    rcx");
-            writeline(out_file, "    pop    rax");
-            writeline(out_file, "    sub    rax, rcx");
-            writeline(out_file, "    push   rax");
+            writeline(*out, "    pop    rcx");
+            writeline(*out, "    pop    rax");
+            writeline(*out, "    sub    rax, rcx");
+            writeline(*out, "    push   rax");
         break;
         case TokenType::_MUL:
-            writeline(out_file, "    pop    rcx");
-            writeline(out_file, "    pop    rax");
-            writeline(out_file, "    mul    rcx");
-            writeline(out_file, "    push   rax");
+            writeline(*out, "    pop    rcx");
+            writeline(*out, "    pop    rax");
+            writeline(*out, "    mul    rcx");
+            writeline(*out, "    push   rax");
         break;
         case TokenType::_DIV:
-            writeline(out_file, "    pop    rcx");
-            writeline(out_file, "    pop    rax");
-            writeline(out_file, "    xor    rdx, rdx");
-            writeline(out_file, "    div    rcx");
-            writeline(out_file, "    push   rax");
+            writeline(*out, "    pop    rcx");
+            writeline(*out, "    pop    rax");
+            writeline(*out, "    xor    rdx, rdx");
+            writeline(*out, "    div    rcx");
+            writeline(*out, "    push   rax");
         break; 
         case TokenType::_MOD:
-            writeline(out_file, "    xor    rdx, rdx");
-            writeline(out_file, "    pop    rcx");
-            writeline(out_file, "    pop    rax");
-            writeline(out_file, "    div    rcx");
-            writeline(out_file, "    push   rdx");
+            // modulo by zero leaves the dividend, same as the interpreter
+            writeline(*out, "    pop    rcx");
+            writeline(*out, "    pop    rax");
+            writeline(*out, "    test   rcx, rcx");
+            writeline(*out, "    jz     glomp_modz_" + std::to_string(pc));
+            writeline(*out, "    xor    rdx, rdx");
+            writeline(*out, "    div    rcx");
+            writeline(*out, "    mov    rax, rdx");
+            writeline(*out, "glomp_modz_" + std::to_string(pc) + ":");
+            writeline(*out, "    push   rax");
         break; 
         case TokenType::_OUT:
-            writeline(out_file, "    pop    rdi");
-            writeline(out_file, "    call   glomp_printint");
+            writeline(*out, "    pop    rdi");
+            writeline(*out, "    call   glomp_printint");
         break;
         case TokenType::_PUT:
-            writeline(out_file, "    pop    rdi");
-            writeline(out_file, "    call   glomp_printchar");
+            writeline(*out, "    pop    rdi");
+            writeline(*out, "    call   glomp_printchar");
+        break;
+        case TokenType::_PUTS:
+            // the whole string in one write
+            writeline(*out, "    pop    rdx");
+            writeline(*out, "    pop    rsi");
+            writeline(*out, "    mov    rax, 1");
+            writeline(*out, "    mov    rdi, 1");
+            writeline(*out, "    syscall");
         break;
         case TokenType::_DMP:
-            writeline(out_file, "    call   glomp_dumpstack");
+            writeline(*out, "    call   glomp_dumpstack");
         break;
         case TokenType::_DUP:
-            writeline(out_file, "    pop    rax");
-            writeline(out_file, "    push   rax");
-            writeline(out_file, "    push   rax");
+            writeline(*out, "    pop    rax");
+            writeline(*out, "    push   rax");
+            writeline(*out, "    push   rax");
         break;
         case TokenType::_DUP2:
-            writeline(out_file, "    pop    rax");
-            writeline(out_file, "    pop    rcx");
-            writeline(out_file, "    push   rcx");
-            writeline(out_file, "    push   rax");
-            writeline(out_file, "    push   rcx");
-            writeline(out_file, "    push   rax");
+            writeline(*out, "    pop    rax");
+            writeline(*out, "    pop    rcx");
+            writeline(*out, "    push   rcx");
+            writeline(*out, "    push   rax");
+            writeline(*out, "    push   rcx");
+            writeline(*out, "    push   rax");
         break;
         case TokenType::_ROT:
-            writeline(out_file, "    pop    rax"); //3
-            writeline(out_file, "    pop    rcx"); //2
-            writeline(out_file, "    pop    rdx"); //1
-            writeline(out_file, "    push   rcx"); // 2
-            writeline(out_file, "    push   rax");// 1
-            writeline(out_file, "    push   rdx");// 3
+            writeline(*out, "    pop    rax"); //3
+            writeline(*out, "    pop    rcx"); //2
+            writeline(*out, "    pop    rdx"); //1
+            writeline(*out, "    push   rcx"); // 2
+            writeline(*out, "    push   rax");// 1
+            writeline(*out, "    push   rdx");// 3
         break;
         case TokenType::_SWP:
-            writeline(out_file, "    pop    rax");
-            writeline(out_file, "    pop    rcx");
-            writeline(out_file, "    push   rax");
-            writeline(out_file, "    push   rcx");
+            writeline(*out, "    pop    rax");
+            writeline(*out, "    pop    rcx");
+            writeline(*out, "    push   rax");
+            writeline(*out, "    push   rcx");
         break;
         case TokenType::_DROP:
-            writeline(out_file, "; drop clobbers r13, consider this in the future");
-            writeline(out_file, "    pop    r13");
-            //writeline(out_file, "    mov    rax, 0");
-            //writeline(out_file, "    add    rsp, 8");
-        break;
-        case TokenType::_IF:
-            writeline(out_file, ";; ~~~~~   if block ~~~~~ ;;");
-            writeline(out_file, "    pop     rax");
-            writeline(out_file, "    cmp     rax, 0");
-            if (tokens[t.value].type == TokenType::_ELSE) writeline(out_file, "    je     glomp_else_" + std::to_string(uint64_t(t.value)));
-            else writeline(out_file, "    je     glomp_end_" + std::to_string(uint64_t(t.value)));
+            writeline(*out, "; drop clobbers r13, consider this in the future");
+            writeline(*out, "    pop    r13");
+            //writeline(*out, "    mov    rax, 0");
+            //writeline(*out, "    add    rsp, 8");
         break;
+        case TokenType::_IF: {
+            const size_t else_pc = tokens.types[value] == TokenType::_ELSE ? value : 0;
+            const size_t end_pc = else_pc ? tokens.values[else_pc] : value;
+            const BranchLayout layout = branchLayout(profile, pc);
+
+            // a branch with a strong bias predicts well, keep it and its layout,
+            // one the profile found unpredictable is lowered even without branchless
+            const bool select = layout == BranchLayout::SELECT
+                             || (branchless && layout == BranchLayout::DEFAULT);
+            if (select && emitSelect(*out, tokens, pc, else_pc, end_pc)) {
+                pc = end_pc;
+                break;
+            }
+
+            writeline(*out, ";; ~~~~~   if block ~~~~~ ;;");
+            writeline(*out, "    pop     rax");
+            writeline(*out, "    cmp     rax, 0");
+            if (layout == BranchLayout::COLD_THEN) {
+                // rarely taken, the then arm goes to the cold section and the rest falls through
+                writeline(*out, "    jne    glomp_then_" + std::to_string(pc));
+                beginCapture();
+                writeline(*out, "glomp_then_" + std::to_string(pc) + ":");
+                cold_arms.push_back({else_pc ? else_pc : end_pc, end_pc});
+                break;
+            }
+            if (layout == BranchLayout::COLD_ELSE && else_pc) cold_elses.push_back(else_pc);
+            if (else_pc) writeline(*out, "    je     glomp_else_" + std::to_string(value));
+            else writeline(*out, "    je     glomp_end_" + std::to_string(value));
+        } break;
         case TokenType::_ELSE:
-            writeline(out_file, ";; ~~~~~ else block ~~~~~ ;;");
-            writeline(out_file, "    jmp     glomp_end_" + std::to_string(t.value));
-            writeline(out_file, "glomp_else_" + std::to_string(pc) + ":");
+            if (!cold_arms.empty() && cold_arms.back().first == pc) {
+                // the cold then arm jumps back to the end, the else arm falls through
+                endColdArm();
+                writeline(*out, ";; ~~~~~ else block ~~~~~ ;;");
+            }
+            else if (!cold_elses.empty() && cold_elses.back() == pc) {
+                cold_elses.pop_back();
+                writeline(*out, ";; ~~~~~ else block (cold) ~~~~~ ;;");
+                beginCapture();
+                writeline(*out, "glomp_else_" + std::to_string(pc) + ":");
+                cold_arms.push_back({value, value});
+            }
+            else {
+                writeline(*out, ";; ~~~~~ else block ~~~~~ ;;");
+                writeline(*out, "    jmp     glomp_end_" + std::to_string(value));
+                writeline(*out, "glomp_else_" + std::to_string(pc) + ":");
+            }
         break;
         case TokenType::_END:
-            writeline(out_file, ";; ~~~~~  end block ~~~~~ ;;");
-            writeline(out_file, "glomp_end_" + std::to_string(pc) + ":");
+            if (value < pc) {
+                // loop end - the condition is tested at the bottom and jumps back to the body
+                writeline(*out, ";; ~~~~~  loop test ~~~~~ ;;");
+                writeline(*out, "glomp_cond_" + std::to_string(value) + ":");
+                *out << loop_tests.back();
+                loop_tests.pop_back();
+            }
+            if (!cold_arms.empty() && cold_arms.back().first == pc) endColdArm();
+            writeline(*out, ";; ~~~~~  end block ~~~~~ ;;");
+            writeline(*out, "glomp_end_" + std::to_string(pc) + ":");
         break;
-        case TokenType::_GR:
-            writeline(out_file, "    pop     rcx");
-            writeline(out_file, "    pop     rax");
-            writeline(out_file, "    cmp     rax, rcx");
-            writeline(out_file, "    seta    al");
-            writeline(out_file, "    push    rax");
+        case TokenType::_WHILE:
+            // capture the condition, it is emitted after the body
+            loop_heads.push_back(pc);
+            beginCapture();
         break;
+        case TokenType::_DO: {
+            const std::string loop = std::to_string(loop_heads.back());
+            std::string test = endCapture();
+
+            if (loop_jcc.empty()) {
+                test += "    pop     rax\n";
+                test += "    test    rax, rax\n";
+                loop_jcc = "jnz";
+            }
+            test += "    " + loop_jcc + "     glomp_body_" + loop + "\n";
+            loop_jcc.clear();
+            loop_tests.push_back(test);
+            loop_heads.pop_back();
+
+            writeline(*out, ";; ~~~~~ while block ~~~~~ ;;");
+            writeline(*out, "    jmp     glomp_cond_" + loop);
+            writeline(*out, "    align   16");
+            writeline(*out, "glomp_body_" + loop + ":");
+        } break;
+        case TokenType::_GR:
         case TokenType::_GE:
-            writeline(out_file, "    pop     rcx");
-            writeline(out_file, "    pop     rax");
-            writeline(out_file, "    cmp     rax, rcx");
-            writeline(out_file, "    setae   al");
-            writeline(out_file, "    push    rax");
-        break;
         case TokenType::_EQ:
-            writeline(out_file, "    pop     rcx");
-            writeline(out_file, "    pop     rax");
-            writeline(out_file, "    cmp     rax, rcx");
-            writeline(out_file, "    sete    al");
-            writeline(out_file, "    push    rax");
-        break;
         case TokenType::_LE:
-            writeline(out_file, "    pop     rcx");
-            writeline(out_file, "    pop     rax");
-            writeline(out_file, "    cmp     rax, rcx");
-            writeline(out_file, "    setbe   al");
-            writeline(out_file, "    push    rax");
-        break;
         case TokenType::_LT:
-            writeline(out_file, "    pop     rcx");
-            writeline(out_file, "    pop     rax");
-            writeline(out_file, "    cmp     rax, rcx");
-            writeline(out_file, "    setb    al");
-            writeline(out_file, "    push    rax");
-        break;
         case TokenType::_NT:
-            writeline(out_file, "    pop     rcx");
-            writeline(out_file, "    pop     rax");
-            writeline(out_file, "    cmp     rax, rcx");
-            writeline(out_file, "    setne   al");
-            writeline(out_file, "    push    rax");
+            writeline(*out, "    pop     rcx");
+            writeline(*out, "    pop     rax");
+            writeline(*out, "    cmp     rax, rcx");
+            // a loop condition ending in a comparison branches on the flags directly
+            if (tokens.types[pc + 1] == TokenType::_DO) {
+                loop_jcc = "j" + conditionCode(tokens.types[pc]);
+                break;
+            }
+            writeline(*out, "    set" + conditionCode(tokens.types[pc]) + "    al");
+            writeline(*out, "    movzx   eax, al");
+            writeline(*out, "    push    rax");
         break;
         case TokenType::_EOF:
-            writeline(out_file, "    mov    rax, 60");
-            writeline(out_file, "    pop    rdi");
-            writeline(out_file, "    syscall");
+            writeline(*out, "    mov    rax, 60");
+            writeline(*out, "    pop    rdi");
+            writeline(*out, "    syscall");
         break;
         case TokenType::_INV:
         default:
@@ -299,11 +861,314 @@ glomp_dumpstackdone:
         }
     }
     
+    if (!cold_text.empty()) {
+        writeline(out_file, "\n;; ~~~~~  cold arms ~~~~~ ;;");
+        out_file << cold_text;
+    }
+
     // data segment
     writeline(out_file, "\nsegment .data");
     writeline(out_file, "glomp_dumpstr:    db  \"Dumping stack:\",10");
+    if (has_procs) writeline(out_file, "glomp_overflowstr:    db  \"Runtime Error: call stack overflow!\",10");
+
+    // string literals, deduplicated by the lexer
+    if (!tokens.strings.empty()) writeline(out_file, "\nsegment .rodata");
+    for (size_t i = 0; i < tokens.strings.size(); ++i) {
+        const StringRef &ref = tokens.strings[i];
+        std::string line = "glomp_str_" + std::to_string(i) + ":";
+        for (uint64_t c = 0; c < ref.length; ++c) {
+            line += (c ? "," : "    db  ") + std::to_string(uint8_t(tokens.string_data[ref.offset + c]));
+        }
+        writeline(out_file, line);
+    }
+
+    if (has_procs) {
+        writeline(out_file, "\nsegment .bss");
+        writeline(out_file, "glomp_ret_stack:    resq    " + std::to_string(return_stack_slots));
+    }
+
+    out_file.flush();
+    if (!out_file) {
+        std::cerr << "failed writing asm for: " << out_path << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    if (!asmonly) {
+        bool ok = call_nasm_ld(fd_buf.fd, out_path);
+        fd_buf.close();
+        if (!ok) exit(EXIT_FAILURE);
+    }
+}
+
+void compileC(const TokenStream &tokens, std::string out_path, bool srconly) {
+    assert((TokenType::_COUNT == 33) && "Exhaustive handling of tokens in compileC()");
+    // -a writes <out>.c, otherwise the source is piped into cc while it is generated
+    std::filebuf file_buf;
+    FdBuf pipe_buf;
+    pid_t cc_pid = -1;
+    if (srconly) {
+        if (!file_buf.open(out_path + ".c", std::ios::out | std::ios::trunc)) {
+            std::cerr << "unable to create file: " << out_path << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    else {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) != 0) {
+            std::cerr << "unable to create pipe: " << std::strerror(errno) << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        // a cc that dies early must not take us down with SIGPIPE, its status is reported instead
+        signal(SIGPIPE, SIG_IGN);
+        cc_pid = spawn({"cc", "-O2", "-x", "c", "-", "-o", out_path}, fds[0]);
+        close(fds[0]);
+        if (cc_pid < 0) exit(EXIT_FAILURE);
+        pipe_buf.open(fds[1]);
+    }
+    std::ostream out_file(srconly ? static_cast<std::streambuf*>(&file_buf) : &pipe_buf);
+
+    // runtime - stack, buffered stdout and the print routines
+writeline(out_file, R"(#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+)");
+    writeline(out_file, "#define GLOMP_STACK_CAP " + std::to_string(data_stack_slots));
+    writeline(out_file, "#define GLOMP_CALL_CAP " + std::to_string(return_stack_slots));
+writeline(out_file, R"(#define GLOMP_OUTBUF_CAP (1 << 16)
+
+static char glomp_outbuf[GLOMP_OUTBUF_CAP];
+static size_t glomp_outlen = 0;
+
+static void glomp_flush(void) {
+    size_t off = 0;
+    while (off < glomp_outlen) {
+        ssize_t n = write(1, glomp_outbuf + off, glomp_outlen - off);
+        if (n <= 0) break;
+        off += (size_t)n;
+    }
+    glomp_outlen = 0;
+}
+
+static inline void glomp_printchar(uint64_t c) {
+    if (glomp_outlen == GLOMP_OUTBUF_CAP) glomp_flush();
+    glomp_outbuf[glomp_outlen++] = (char)c;
+}
+
+static void glomp_printint(uint64_t v) {
+    char tmp[20];
+    int n = 0;
+    do { tmp[n++] = (char)('0' + v % 10); v /= 10; } while (v);
+    if (glomp_outlen + n > GLOMP_OUTBUF_CAP) glomp_flush();
+    while (n) glomp_outbuf[glomp_outlen++] = tmp[--n];
+}
+
+static void glomp_puts(const char *str, uint64_t len) {
+    if (len > GLOMP_OUTBUF_CAP - glomp_outlen) {
+        glomp_flush();
+        if (len > GLOMP_OUTBUF_CAP) {
+            while (len) {
+                ssize_t n = write(1, str, len);
+                if (n <= 0) break;
+                str += n;
+                len -= (uint64_t)n;
+            }
+            return;
+        }
+    }
+    memcpy(glomp_outbuf + glomp_outlen, str, len);
+    glomp_outlen += len;
+}
+
+static void glomp_dumpstack(const uint64_t *stack, const uint64_t *sp) {
+    const char *hdr = "Dumping stack:\n";
+    while (*hdr) glomp_printchar((uint64_t)*hdr++);
+    for (long i = (long)(sp - stack) - 1; i >= 0; --i) {
+        glomp_printchar('[');
+        glomp_printint((uint64_t)i);
+        glomp_printchar(']');
+        glomp_printchar(' ');
+        glomp_printint(stack[i]);
+        glomp_printchar('\n');
+    }
+}
+
+// procedures are C functions, their depth is counted to stop where the other engines do
+static uint64_t glomp_call_depth = 0;
+
+static void glomp_calloverflow(int line, int column) {
+    glomp_flush();
+    fprintf(stderr, "Runtime Error: call stack overflow! Location %d:%d\n", line, column);
+    exit(EXIT_FAILURE);
+}
+
+static void glomp_divzero(int line, int column) {
+    glomp_flush();
+    fprintf(stderr, "Divide by zero! Location %d:%d\n", line, column);
+    exit(EXIT_FAILURE);
+}
+)");
+
+    // string literals, deduplicated by the lexer
+    for (size_t i = 0; i < tokens.strings.size(); ++i) {
+        const StringRef &ref = tokens.strings[i];
+        std::string line = "static const char glomp_str_" + std::to_string(i) + "[] = {";
+        for (uint64_t c = 0; c < ref.length; ++c) {
+            line += std::to_string(int(uint8_t(tokens.string_data[ref.offset + c]))) + ",";
+        }
+        writeline(out_file, line + "0};");
+    }
+
+    // procedures are separate functions taking and returning the stack pointer
+    for (size_t pc = 0; pc < tokens.size(); ++pc) {
+        if (tokens.types[pc] != TokenType::_PROC) continue;
+        writeline(out_file, "static uint64_t *glomp_proc_" + std::to_string(pc) + "(uint64_t *sp, uint64_t *stack);");
+    }
+
+writeline(out_file, R"(
+int main(void) {
+    static uint64_t stack[GLOMP_STACK_CAP];
+    uint64_t *sp = stack;
+    uint64_t a, b, c;
+    (void)a; (void)b; (void)c;
+)");
+
+    auto quit = [&](std::string msg) {
+        if (srconly) {
+            file_buf.close();
+            out_path += ".c";
+            int result = std::remove(out_path.c_str());
+            if (result) std::cerr << "unable to delete: " << out_path << std::endl;
+        }
+        else {
+            kill(cc_pid, SIGTERM);
+            waitpid(cc_pid, nullptr, 0);
+        }
+        std::cerr << msg << std::endl;
+        exit(EXIT_FAILURE);
+    };
+
+    std::ostream *out = &out_file;    // procedure bodies are captured and emitted after main
+    std::ostringstream proc_text;
+
+    // binary operators only differ by the expression pushed back
+    auto binop = [&](std::string expr) {
+        writeline(*out, "    b = *--sp; a = *--sp; *sp++ = " + expr + ";");
+    };
 
-    out_file.close();
+    for (size_t pc = 0; pc < tokens.size(); ++pc) {
+        const uint64_t value = tokens.values[pc];
+
+        switch (tokens.types[pc]) {
+        case TokenType::_INT:
+        case TokenType::_CHR:
+            writeline(*out, "    *sp++ = " + std::to_string(value) + "ull;");
+        break;
+        case TokenType::_STR:
+            writeline(*out, "    *sp++ = (uint64_t)(uintptr_t)glomp_str_" + std::to_string(value) + ";");
+            writeline(*out, "    *sp++ = " + std::to_string(tokens.strings[value].length) + "ull;");
+        break;
+        case TokenType::_IDN:
+            writeline(*out, "    if (glomp_call_depth == GLOMP_CALL_CAP) glomp_calloverflow(" + std::to_string(tokens.locations[pc].line) + ", " + std::to_string(tokens.locations[pc].column) + ");");
+            writeline(*out, "    ++glomp_call_depth;");
+            writeline(*out, "    sp = glomp_proc_" + std::to_string(value) + "(sp, stack);");
+            writeline(*out, "    --glomp_call_depth;");
+        break;
+        case TokenType::_PROC:
+            out = &proc_text;
+            writeline(*out, "\n// proc " + tokens.name(pc + 1));
+            writeline(*out, "static uint64_t *glomp_proc_" + std::to_string(pc) + "(uint64_t *sp, uint64_t *stack) {");
+            writeline(*out, "    uint64_t a, b, c;");
+            writeline(*out, "    (void)a; (void)b; (void)c; (void)stack;");
+            ++pc; // name
+        break;
+        case TokenType::_RET:
+            writeline(*out, "    return sp;");
+            writeline(*out, "}");
+            out = &out_file;
+        break;
+        case TokenType::_ADD: binop("a + b"); break;
+        case TokenType::_SUB: binop("a - b"); break;
+        case TokenType::_MUL: binop("a * b"); break;
+        case TokenType::_DIV:
+            writeline(*out, "    b = *--sp; a = *--sp;");
+            writeline(*out, "    if (b == 0) glomp_divzero(" + std::to_string(tokens.locations[pc].line) + ", " + std::to_string(tokens.locations[pc].column) + ");");
+            writeline(*out, "    *sp++ = a / b;");
+        break;
+        case TokenType::_MOD:
+            // matches the interpreter: modulo by zero leaves the dividend
+            binop("b ? a % b : a");
+        break;
+        case TokenType::_OUT:
+            writeline(*out, "    glomp_printint(*--sp);");
+        break;
+        case TokenType::_PUT:
+            writeline(*out, "    glomp_printchar(*--sp);");
+        break;
+        case TokenType::_PUTS:
+            writeline(*out, "    b = *--sp; a = *--sp; glomp_puts((const char *)(uintptr_t)a, b);");
+        break;
+        case TokenType::_DMP:
+            writeline(*out, "    glomp_dumpstack(stack, sp);");
+        break;
+        case TokenType::_DUP:
+            writeline(*out, "    a = sp[-1]; *sp++ = a;");
+        break;
+        case TokenType::_DUP2:
+            writeline(*out, "    a = sp[-2]; b = sp[-1]; *sp++ = a; *sp++ = b;");
+        break;
+        case TokenType::_ROT:
+            writeline(*out, "    a = sp[-3]; sp[-3] = sp[-2]; sp[-2] = sp[-1]; sp[-1] = a;");
+        break;
+        case TokenType::_SWP:
+            writeline(*out, "    a = sp[-2]; sp[-2] = sp[-1]; sp[-1] = a;");
+        break;
+        case TokenType::_DROP:
+            writeline(*out, "    --sp;");
+        break;
+        case TokenType::_IF:
+            writeline(*out, "    if (*--sp) {");
+        break;
+        case TokenType::_ELSE:
+            writeline(*out, "    } else {");
+        break;
+        case TokenType::_END:
+            writeline(*out, "    }");
+        break;
+        case TokenType::_WHILE:
+            writeline(*out, "    while (1) {");
+        break;
+        case TokenType::_DO:
+            writeline(*out, "    if (!*--sp) break;");
+        break;
+        case TokenType::_GR: binop("a > b");  break;
+        case TokenType::_GE: binop("a >= b"); break;
+        case TokenType::_EQ: binop("a == b"); break;
+        case TokenType::_LE: binop("a <= b"); break;
+        case TokenType::_LT: binop("a < b");  break;
+        case TokenType::_NT: binop("a != b"); break;
+        case TokenType::_EOF:
+            writeline(*out, "    glomp_flush();");
+            writeline(*out, "    return (int)*--sp;");
+        break;
+        case TokenType::_INV:
+        default:
+            quit("unreachable - compileC()");
+        break;
+        }
+    }
+    writeline(out_file, "}");
+    out_file << proc_text.str();
 
-    if (!asmonly) call_nasm_ld(out_path);
+    out_file.flush();
+    if (srconly) {
+        if (!out_file) {
+            std::cerr << "failed writing C for: " << out_path << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        return;
+    }
+    pipe_buf.close();
+    if (!waitChild(cc_pid, "cc")) exit(EXIT_FAILURE);
 }
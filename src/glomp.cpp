@@ -4,76 +4,161 @@
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <unordered_map>
+#include <memory>
+#include <filesystem>
+#include <cerrno>
+#include <cstring>
+namespace fs = std::filesystem;
+
+extern "C" {
+    #include <unistd.h> // for fork
+    #include <sys/wait.h> // for waitpid
+}
 
 #include "lexer.hpp"
 #include "interpreter.hpp"
 #include "compiler.hpp"
+#include "optimizer.hpp"
+#include "bytecode.hpp"
+#include "profile.hpp"
 
 void usage() {
-    std::cout << "Usage: glomp [option] <input.glmp>\n"
+    std::cout << "Usage: glomp [option] <input.glmp>...\n"
               << "    -i    interpret program\n"
               << "    -c    compile program\n"
+              << "    -C    compile program through C (cc -O2)\n"
+              << "    -b    write linked bytecode (.glmc)\n"
+              << "          run it with glomp -i <input.glmc>\n"
               << "    -d    dump tokens to stdout\n"
               << "    -o    <output_path/filename>\n"
-              << "    -a    generate asm\n"
-              << "          -a is ignored if -i is present\n";
+              << "    -a    generate asm (or C with -C)\n"
+              << "          -a is ignored if -i is present\n"
+              << "    --no-inline\n"
+              << "          keep every procedure call, -d reports what inlining did\n"
+              << "    --no-cmov\n"
+              << "          keep branches for short pure if/else arms with -c,\n"
+              << "          except those --profile-use found unpredictable\n"
+              << "    -jN   build up to N inputs in parallel\n"
+              << "          several inputs with -i are interleaved on one thread\n"
+              << "    --out-dir=<dir>\n"
+              << "          output directory when building several inputs\n"
+              << "    -p    <profile_path> record `if` branch counts while interpreting\n"
+              << "    --profile-use=<profile_path>\n"
+              << "          lay out `if` blocks from a recorded profile with -c\n";
 }
 
-std::string getSource(std::string path) {
+bool getSource(std::string path, std::string &src, std::string &error) {
     std::ifstream file(path);
 
     if (!file.is_open()) {
-        std::cerr << "Failed to open file: " << path << std::endl;
-        exit(EXIT_FAILURE);
+        error = "Failed to open file: " + path;
+        return false;
     }
     std::stringstream buffer;
     buffer << file.rdbuf();
     file.close();
 
-    return buffer.str();
+    src = buffer.str();
+    return true;
 }
 
 //TODO: This function is way too simple
-bool validate(const std::vector<Token>& tokens) {
-    if (std::find_if(tokens.begin(), tokens.end(), [](const Token &t){ return t.type == TokenType::_INV; }) != tokens.end()) {
-        std::cout << "Invalid Token" << std::endl;
+bool validate(const TokenStream& tokens, std::string &error) {
+    if (std::find(tokens.types.begin(), tokens.types.end(), TokenType::_INV) != tokens.types.end()) {
+        error = "Invalid Token";
         return false;
     }
 
     return true;
 }
 
-void linkBlocks(std::vector<Token> &tokens) {
+// false with error set on unbalanced blocks or unknown names
+bool linkBlocks(TokenStream &tokens, std::string &error) {
+    auto fail = [&](std::string msg, const Location &loc) {
+        error = msg + ": " + std::to_string(loc.line) + ":" + std::to_string(loc.column);
+        return false;
+    };
+
+    // procedures can be called before their definition, collect them first
+    std::unordered_map<uint64_t, size_t> procs;   // name (string index) -> `proc` token
+    for (size_t pc = 0; pc < tokens.size(); ++pc) {
+        if (tokens.types[pc] != TokenType::_PROC) continue;
+        const Location &loc = tokens.locations[pc];
+        if (tokens.types[pc + 1] != TokenType::_IDN) {
+            return fail("`proc` must be followed by a name", loc);
+        }
+        if (!procs.emplace(tokens.values[pc + 1], pc).second) {
+            return fail("procedure `" + tokens.name(pc + 1) + "` is already defined", loc);
+        }
+    }
+
     size_t pc = 0;
     std::vector<size_t> ip_stack;
     while (pc < tokens.size()) {
-        Token &t = tokens[pc];
-        switch (t.type) {
+        const Location &loc = tokens.locations[pc];
+        switch (tokens.types[pc]) {
+            case TokenType::_PROC:
+                if (!ip_stack.empty()) {
+                    return fail("procedures must be defined at the top level", loc);
+                }
+                ip_stack.push_back(pc);
+                ++pc; // the name is not a call
+            break;
+            // calls are linked to the `proc` token, the body starts after its name
+            case TokenType::_IDN: {
+                auto it = procs.find(tokens.values[pc]);
+                if (it == procs.end()) {
+                    return fail("unknown word `" + tokens.name(pc) + "`", loc);
+                }
+                tokens.values[pc] = uint64_t(it->second);
+            } break;
             case TokenType::_IF:
 //                std::cout << "found if at pc = " << pc << "\n";
                 ip_stack.push_back(pc); 
             break;
             case TokenType::_ELSE:
                 if (ip_stack.empty()) {
-                    std::cerr << "`else` without matching `if`: " << t.line << ":" << t.column << "\n";
-                    exit(EXIT_FAILURE);
+                    return fail("`else` without matching `if`", loc);
                 }
-                if (tokens[ip_stack.back()].type == TokenType::_IF) {
-                    tokens[ip_stack.back()].value = uint64_t(pc);
+                if (tokens.types[ip_stack.back()] == TokenType::_IF) {
+                    tokens.values[ip_stack.back()] = uint64_t(pc);
                     ip_stack.pop_back();
                     ip_stack.push_back(pc);
                 } else {
-                    std::cerr << "`else` can only close `if` blocks: " << t.line << ":" << t.column << "\n";
-                    exit(EXIT_FAILURE);
+                    return fail("`else` can only close `if` blocks", loc);
+                }
+            break;
+            case TokenType::_WHILE:
+                ip_stack.push_back(pc);
+            break;
+            case TokenType::_DO:
+                if (ip_stack.empty() || tokens.types[ip_stack.back()] != TokenType::_WHILE) {
+                    return fail("`do` without matching `while`", loc);
                 }
+                // remember the loop head until `end` is found
+                tokens.values[pc] = uint64_t(ip_stack.back());
+                ip_stack.pop_back();
+                ip_stack.push_back(pc);
             break;
+            // `end` holds its jump target: the next token for if/else, the `while` for loops
             case TokenType::_END:
                 if (ip_stack.empty()) {
-                    std::cerr << "`end` without matching `if/else`: " << t.line << ":" << t.column << "\n";
-                    exit(EXIT_FAILURE);
+                    return fail("`end` without matching `if/else/do/proc`", loc);
                 }
   //              std::cout << "found end at pc = " << pc << " setting if at pc = " << ip_stack.back() << " to " << (pc + 1) << "\n";
-                tokens[ip_stack.back()].value = uint64_t(pc);
+                if (tokens.types[ip_stack.back()] == TokenType::_DO) {
+                    tokens.values[pc] = tokens.values[ip_stack.back()];
+                }
+                else if (tokens.types[ip_stack.back()] == TokenType::_PROC) {
+                    tokens.types[pc] = TokenType::_RET;
+                    tokens.values[pc] = 0;
+                }
+                else if (tokens.types[ip_stack.back()] == TokenType::_WHILE) {
+                    return fail("`while` without `do`", loc);
+                }
+                else tokens.values[pc] = uint64_t(pc + 1);
+                tokens.values[ip_stack.back()] = uint64_t(pc);
                 ip_stack.pop_back();
             break;
             default:
@@ -83,83 +168,354 @@ void linkBlocks(std::vector<Token> &tokens) {
     }
     if (!ip_stack.empty()) {
     // TODO: Better error handling here
-        std::cerr << "incomplete if statements\n";
-        exit(EXIT_FAILURE);
+        error = "incomplete if/while/proc statements";
+        return false;
     }
+    return true;
 }
 
 enum class Mode {
     ERROR,
     COMPILE,
+    COMPILE_C,
+    BYTECODE,
     INTERPRET
 };
 
+struct Options {
+    Mode mode = Mode::ERROR;
+    bool dump = false;
+    bool asmonly = false;
+    bool inline_procs = true;
+    bool branchless = true;
+    std::string profile_out;
+    std::string profile_in;
+};
+
+// front end: tokens of a source file, validated, inlined and linked,
+// false with error set when any step fails
+bool loadSource(const Options &opts, std::string in_file, TokenStream &tokens, std::string &error) {
+    std::string src;
+    if (!getSource(in_file, src, error) || !tokenize(src, tokens, error)) return false;
+    if (opts.dump) printTokens(tokens);
+    
+    if (!validate(tokens, error)) return false;
+    
+    // before linking so every mode, and the profile indices, see the same stream
+    if (opts.inline_procs) {
+        const bool has_procs = std::find(tokens.types.begin(), tokens.types.end(), TokenType::_PROC) != tokens.types.end();
+        InlineStats stats = inlineProcs(tokens);
+        if (opts.dump && has_procs) {
+            std::cout << "inlined " << stats.calls_inlined << " calls, removed " << stats.procs_removed
+                      << " procs, tokens " << stats.tokens_before << " -> " << stats.tokens_after << "\n";
+        }
+    }
+
+    return linkBlocks(tokens, error);
+}
+
+// run or build a single input
+int processFile(const Options &opts, std::string in_file, std::string out_file) {
+    // precompiled bytecode is already validated and linked, run it straight from the mapping
+    if (isBytecodePath(in_file)) {
+        if (opts.mode != Mode::INTERPRET) {
+            std::cerr << "error: bytecode files can only be interpreted (-i)" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        MappedBytecode mapped;
+        std::string error;
+        if (!mapBytecode(in_file, mapped, error)) {
+            std::cerr << in_file << ": " << error << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if (opts.profile_out.empty()) return interpret(mapped.view());
+
+        BranchProfile profile(mapped.view().size());
+        int return_val = interpret(mapped.view(), &profile);
+        writeProfile(profile, opts.profile_out);
+        return return_val;
+    }
+
+    TokenStream tokens;
+    std::string error;
+    if (!loadSource(opts, in_file, tokens, error)) {
+        std::cerr << error << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    int return_val = 0;
+    switch (opts.mode) {
+        case Mode::INTERPRET:
+            if (opts.profile_out.empty()) return_val = interpret(tokens);
+            else {
+                BranchProfile profile(tokens.size());
+                return_val = interpret(tokens, &profile);
+                writeProfile(profile, opts.profile_out);
+            }
+            break;
+        case Mode::COMPILE:
+            if (opts.profile_in.empty()) compile(tokens, out_file, opts.asmonly, nullptr, opts.branchless);
+            else {
+                BranchProfile profile;
+                if (!readProfile(opts.profile_in, tokens.size(), profile)) exit(EXIT_FAILURE);
+                compile(tokens, out_file, opts.asmonly, &profile, opts.branchless);
+            }
+            break;
+        case Mode::COMPILE_C:
+            compileC(tokens, out_file, opts.asmonly);
+            break;
+        case Mode::BYTECODE:
+            writeBytecode(tokens, out_file);
+            break;
+        default:
+            std::cerr << "unreachable - mode" << std::endl;
+            exit(EXIT_FAILURE);
+            break;
+    }
+
+    return return_val;
+}
+
+// ops a program runs before the next one gets its turn
+constexpr size_t interpret_slice = 10000;
+
+// Interprets several inputs interleaved on this thread, round robin with a
+// budget of interpret_slice ops each. Output a program produced is written
+// after each of its slices. An input that fails to load is skipped and a
+// runtime error only ends that program.
+int interpretFiles(const std::vector<std::string> &in_files, const Options &opts) {
+    struct Program {
+        std::string name;
+        TokenStream tokens;
+        MappedBytecode mapped;
+        std::string output;
+        std::string error;
+        std::unique_ptr<Interpreter> interpreter;
+    };
+    // the callbacks hold on to their program, keep it in place
+    std::vector<std::unique_ptr<Program>> programs;
+    int failed = 0;
+    for (const auto &in_file : in_files) {
+        auto program = std::make_unique<Program>();
+        Program &p = *program;
+        p.name = in_file;
+        std::string error;
+        const bool loaded = isBytecodePath(in_file) ? mapBytecode(in_file, p.mapped, error)
+                                                    : loadSource(opts, in_file, p.tokens, error);
+        if (!loaded) {
+            std::cerr << in_file << ": " << error << ", skipped" << std::endl;
+            ++failed;
+            continue;
+        }
+        const TokenView view = isBytecodePath(in_file) ? p.mapped.view() : TokenView(p.tokens);
+        p.interpreter = std::make_unique<Interpreter>(view,
+            [&p](const char *data, size_t length) { p.output.append(data, length); },
+            [&p](const std::string &message) { p.error = message; });
+        programs.push_back(std::move(program));
+    }
+
+    size_t running = programs.size();
+    while (running) {
+        for (auto &program : programs) {
+            if (program->interpreter->status() != RunStatus::YIELDED) continue;
+            RunStatus status = program->interpreter->run(interpret_slice);
+            // a slice's output goes out as one piece, programs only interleave between slices
+            std::cout << program->output;
+            program->output.clear();
+            if (status == RunStatus::YIELDED) continue;
+
+            --running;
+            if (status == RunStatus::FAILED) {
+                std::cout.flush();
+                std::cerr << program->name << ": " << program->error << std::endl;
+                ++failed;
+            }
+        }
+        std::cout.flush();
+    }
+
+    if (failed) {
+        std::cerr << failed << " of " << in_files.size() << " inputs failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+// Builds every input in its own forked worker with at most `jobs` in flight,
+// each worker running the front end, codegen and toolchain for one file. Errors
+// end a worker with exit(), so one bad input does not stop the others.
+int processFiles(const Options &opts, const std::vector<std::string> &in_files, std::string out_dir, unsigned jobs) {
+    std::vector<std::string> out_files;
+    for (const auto &in_file : in_files) {
+        fs::path out = fs::path(out_dir) / fs::path(in_file).stem();
+        if (opts.mode == Mode::BYTECODE) out += ".glmc";
+        if (std::find(out_files.begin(), out_files.end(), out.string()) != out_files.end()) {
+            std::cerr << "error: more than one input writes " << out.string() << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        out_files.push_back(out.string());
+    }
+
+    std::error_code ec;
+    fs::create_directories(out_dir, ec);
+    if (ec) {
+        std::cerr << "error: unable to create output directory " << out_dir << ": " << ec.message() << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    std::vector<std::pair<pid_t, size_t>> running;  // worker, input index
+    size_t next = 0;
+    size_t failed = 0;
+    std::cout.flush();
+    while (next < in_files.size() || !running.empty()) {
+        while (running.size() < jobs && next < in_files.size()) {
+            pid_t pid = fork();
+            if (pid < 0) {
+                std::cerr << "unable to start worker for " << in_files[next] << ": " << std::strerror(errno) << std::endl;
+                ++failed;
+                ++next;
+                continue;
+            }
+            if (pid == 0) exit(processFile(opts, in_files[next], out_files[next]));
+            running.push_back({pid, next++});
+        }
+        if (running.empty()) break;
+
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "unable to wait for workers: " << std::strerror(errno) << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        auto it = std::find_if(running.begin(), running.end(), [&](const auto &w) { return w.first == pid; });
+        if (it == running.end()) continue;
+        const std::string &in_file = in_files[it->second];
+        if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+            std::cerr << in_file << ": failed with status " << WEXITSTATUS(status) << std::endl;
+            ++failed;
+        }
+        else if (WIFSIGNALED(status)) {
+            std::cerr << in_file << ": killed by signal " << WTERMSIG(status) << std::endl;
+            ++failed;
+        }
+        running.erase(it);
+    }
+
+    if (failed) {
+        std::cerr << failed << " of " << in_files.size() << " inputs failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
 int main(int argc, char **argv) {
     if (argc <= 2) {
         usage();
         exit(EXIT_FAILURE);
     }
     
+    Options opts;
     std::string out_file = "glmp.out";
-    std::string in_file;
-    bool dump = false;
-    bool asmonly = false;
-    Mode mode = Mode::ERROR;
+    bool out_given = false;
+    std::string out_dir;
+    std::vector<std::string> in_files;
+    unsigned jobs = 1;
     for (int i = 1; i < argc; ++i) {
         std::string option = argv[i];
         if (option == "-i") {
-            if (mode != Mode::ERROR) {
+            if (opts.mode != Mode::ERROR) {
                 std::cerr << "notice: -i and -c are mutually exclusive" << std::endl;
-            } else mode = Mode::INTERPRET;
+            } else opts.mode = Mode::INTERPRET;
         }
         else if (option == "-c") {
-            if (mode != Mode::ERROR) {
+            if (opts.mode != Mode::ERROR) {
                 std::cerr << "notice: -i and -c are mutually exclusive" << std::endl;
-            } else mode = Mode::COMPILE;
+            } else opts.mode = Mode::COMPILE;
         }
-        else if (option == "-d") dump = true;
+        else if (option == "-C") {
+            if (opts.mode != Mode::ERROR) {
+                std::cerr << "notice: -i, -c and -C are mutually exclusive" << std::endl;
+            } else opts.mode = Mode::COMPILE_C;
+        }
+        else if (option == "-b") {
+            if (opts.mode != Mode::ERROR) {
+                std::cerr << "notice: -i, -c, -C and -b are mutually exclusive" << std::endl;
+            } else opts.mode = Mode::BYTECODE;
+        }
+        else if (option == "-d") opts.dump = true;
         else if (option == "-o") {
             if (i + 1 >= argc) { std::cerr << "error: -o must be followed by output path" << std::endl; exit(EXIT_FAILURE); }
             out_file = argv[++i];
+            out_given = true;
+        }
+        else if (option == "-a") opts.asmonly = true;
+        else if (option == "--no-inline") opts.inline_procs = false;
+        else if (option == "--no-cmov") opts.branchless = false;
+        else if (option == "-p") {
+            if (i + 1 >= argc) { std::cerr << "error: -p must be followed by profile path" << std::endl; exit(EXIT_FAILURE); }
+            opts.profile_out = argv[++i];
+        }
+        else if (option.rfind("--profile-use=", 0) == 0) opts.profile_in = option.substr(std::string("--profile-use=").size());
+        else if (option.rfind("--out-dir=", 0) == 0) out_dir = option.substr(std::string("--out-dir=").size());
+        else if (option.rfind("-j", 0) == 0) {
+            std::string count = option.substr(2);
+            if (count.empty() && i + 1 < argc) count = argv[++i];
+            if (count.empty() || count.find_first_not_of("0123456789") != std::string::npos || std::stoul(count) == 0) {
+                std::cerr << "error: -j must be followed by a job count" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            jobs = unsigned(std::stoul(count));
         }
-        else if (option == "-a") asmonly = true;
-        else in_file = argv[i];
+        else in_files.push_back(argv[i]);
     }
 
-    if (in_file.empty()) {
+    if (in_files.empty()) {
         std::cerr << "error: did not provide input file" << std::endl;
         usage();
         exit(EXIT_FAILURE);
     }
-    else if (mode == Mode::ERROR) {
-        std::cerr << "error: -i or -c are required" << std::endl;
+    else if (opts.mode == Mode::ERROR) {
+        std::cerr << "error: -i, -c, -C or -b are required" << std::endl;
         usage();
         exit(EXIT_FAILURE);
     }
-
-    std::vector<Token> tokens = tokenize(getSource(in_file));
-    if (dump) printTokens(tokens);
-    
-    if (!validate(tokens)) {
-        std::cerr << "Failed" << std::endl;
+    if (!opts.profile_out.empty() && opts.mode != Mode::INTERPRET) {
+        std::cerr << "error: -p records a profile while interpreting, it requires -i" << std::endl;
         exit(EXIT_FAILURE);
     }
-    
-    linkBlocks(tokens);
-    
-    int return_val = 0;
-    switch (mode) {
-        case Mode::INTERPRET:
-            return_val = interpret(tokens);
-            break;
-        case Mode::COMPILE:
-            compile(tokens, out_file, asmonly);
-            break;
-        default:
-            std::cerr << "unreachable - mode" << std::endl;
+    if (!opts.profile_in.empty() && opts.mode != Mode::COMPILE) {
+        std::cerr << "error: --profile-use only applies to -c" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    if (opts.mode == Mode::INTERPRET && (in_files.size() > 1 || !out_dir.empty())) {
+        if (!out_dir.empty()) {
+            std::cerr << "error: --out-dir does not apply to -i" << std::endl;
             exit(EXIT_FAILURE);
-            break;
+        }
+        if (!opts.profile_out.empty()) {
+            std::cerr << "error: -p takes a single input file" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        return interpretFiles(in_files, opts);
     }
 
-    return return_val;
+    if (in_files.size() > 1 || !out_dir.empty()) {
+        if (out_given) {
+            std::cerr << "error: use --out-dir instead of -o with several input files" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if (!opts.profile_in.empty()) {
+            std::cerr << "error: --profile-use takes a single input file" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        return processFiles(opts, in_files, out_dir.empty() ? "." : out_dir, jobs);
+    }
+
+    if (opts.mode == Mode::BYTECODE && !out_given) {
+        out_file = fs::path(in_files[0]).replace_extension(".glmc").string();
+    }
+
+    return processFile(opts, in_files[0], out_file);
 }
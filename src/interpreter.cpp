@@ -1,171 +1,297 @@
 #include "interpreter.hpp"
 
+extern "C" {
+    #include <signal.h>     // for sigaction
+    #include <setjmp.h>     // for sigsetjmp
+    #include <unistd.h>     // for sysconf
+    #include <sys/mman.h>   // for mmap
+}
 #include <iostream>
+#include <atomic>
 #include <cassert>
 #include <cinttypes>
 
-inline uint64_t pop(std::vector<uint64_t> &s) {
-    if (s.empty()) {
-        std::cerr << "Runtime Error: stack underflow!" << std::endl;
+// The data stack is a fixed mmap'd region with a PROT_NONE guard page on
+// each side. Ops work through a raw stack pointer without bounds checks,
+// running off either end faults on a guard page and the SIGSEGV handler
+// turns that into the runtime error.
+// Return addresses of procedure calls (return_stack_slots of them) live on a
+// second stack mapped the same way, so runaway recursion is reported instead
+// of eating the data stack.
+
+enum StackFault {
+    NONE,
+    UNDERFLOW,
+    OVERFLOW,
+    RECURSION
+};
+
+// stacks of the interpreter inside run() on this thread, and where to go when they fault
+static thread_local DataStack *fault_stack = nullptr;
+static thread_local DataStack *fault_return_stack = nullptr;
+static thread_local volatile size_t fault_ip = 0;
+static thread_local volatile sig_atomic_t fault_kind = StackFault::NONE;
+static thread_local sigjmp_buf fault_jmp;
+// the handler is installed while any interpreter is alive
+static int live_interpreters = 0;
+static struct sigaction prev_segv;
+
+void stackFaultHandler(int sig, siginfo_t *info, void *) {
+    const uint64_t *addr = static_cast<const uint64_t*>(info->si_addr);
+    if (fault_stack && addr < fault_stack->base && (const void*)addr >= fault_stack->mapping) {
+        fault_kind = StackFault::UNDERFLOW;
+        siglongjmp(fault_jmp, 1);
+    }
+    if (fault_stack && addr >= fault_stack->limit && (const char*)addr < (const char*)fault_stack->mapping + fault_stack->mapping_size) {
+        fault_kind = StackFault::OVERFLOW;
+        siglongjmp(fault_jmp, 1);
+    }
+    if (fault_return_stack && (const char*)addr >= (const char*)fault_return_stack->mapping
+        && (const char*)addr < (const char*)fault_return_stack->mapping + fault_return_stack->mapping_size) {
+        fault_kind = StackFault::RECURSION;
+        siglongjmp(fault_jmp, 1);
+    }
+    // not ours, let it crash as it would have
+    sigaction(SIGSEGV, &prev_segv, nullptr);
+    raise(sig);
+}
+
+DataStack mapDataStack(size_t slots) {
+    const size_t page = size_t(sysconf(_SC_PAGESIZE));
+    const size_t stack_size = slots * sizeof(uint64_t);
+
+    DataStack stack;
+    stack.mapping_size = stack_size + 2 * page;
+    stack.mapping = mmap(nullptr, stack.mapping_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (stack.mapping == MAP_FAILED) {
+        std::cerr << "Runtime Error: unable to allocate data stack" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    char *usable = static_cast<char*>(stack.mapping) + page;
+    if (mprotect(usable, stack_size, PROT_READ | PROT_WRITE) != 0) {
+        std::cerr << "Runtime Error: unable to allocate data stack" << std::endl;
         exit(EXIT_FAILURE);
     }
-    uint64_t a = s.back();
-    s.pop_back();
-    return a;
+    stack.base = reinterpret_cast<uint64_t*>(usable);
+    stack.limit = stack.base + slots;
+    return stack;
+}
+
+void unmapDataStack(DataStack &stack) {
+    munmap(stack.mapping, stack.mapping_size);
+    stack = DataStack();
 }
 
-void dumpStack(const std::vector<uint64_t> &data_stack) {
-    std::cout << "Dumping stack:\n";
-    for (int i = data_stack.size()-1; i >= 0; --i) {
-        std::cout << "[" << i << "] " << data_stack[i] << "\n";
+Interpreter::Interpreter(const TokenView &tokens, OutputFn output, ErrorFn error, BranchProfile *profile)
+    : tokens(tokens), output(std::move(output)), error(std::move(error)), profile(profile) {
+    stack = mapDataStack(data_stack_slots);
+    calls = mapDataStack(return_stack_slots);
+    sp = stack.base;
+    rp = calls.base;
+    if (tokens.size() == 0) state = RunStatus::HALTED;
+
+    if (live_interpreters++ == 0) {
+        // SA_NODEFER leaves SIGSEGV unblocked after the siglongjmp, so run()
+        // does not need sigsetjmp to save and restore the signal mask
+        struct sigaction sa = {};
+        sa.sa_sigaction = stackFaultHandler;
+        sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGSEGV, &sa, &prev_segv);
     }
 }
 
-int interpret(const std::vector<Token> &tokens) {
-    assert((TokenType::_COUNT == 28) && "Exhaustive handling of tokens in interpret()");
-    
-    std::vector<uint64_t> data_stack;   // Program Stack
-    size_t pc = 0;
-
-    uint64_t return_val = 0;
-    while (pc < tokens.size()) {
-        const Token &token = tokens[pc++];
-        uint64_t a, b, c;
-        switch (token.type) {
+Interpreter::~Interpreter() {
+    if (--live_interpreters == 0) sigaction(SIGSEGV, &prev_segv, nullptr);
+    unmapDataStack(calls);
+    unmapDataStack(stack);
+}
+
+void Interpreter::fail(size_t ip, const char *what) {
+    fault_stack = nullptr;
+    fault_return_stack = nullptr;
+    const Location &loc = tokens.locations[ip];
+    state = RunStatus::FAILED;
+    error(std::string(what) + " Location " + std::to_string(loc.line) + ":" + std::to_string(loc.column));
+}
+
+void Interpreter::dumpStack(const uint64_t *sp) {
+    std::string text = "Dumping stack:\n";
+    for (long i = long(sp - stack.base) - 1; i >= 0; --i) {
+        text += "[" + std::to_string(i) + "] " + std::to_string(stack.base[i]) + "\n";
+    }
+    output(text.data(), text.size());
+}
+
+RunStatus Interpreter::run(size_t budget) {
+    assert((TokenType::_COUNT == 33) && "Exhaustive handling of tokens in Interpreter::run()");
+    if (state != RunStatus::YIELDED) return state;
+
+    fault_stack = &stack;
+    fault_return_stack = &calls;
+    if (sigsetjmp(fault_jmp, 0)) {
+        if (fault_kind == StackFault::UNDERFLOW) fail(fault_ip, "Runtime Error: stack underflow!");
+        else if (fault_kind == StackFault::OVERFLOW) fail(fault_ip, "Runtime Error: stack overflow!");
+        else fail(fault_ip, "Runtime Error: call stack overflow!");
+        return state;
+    }
+
+    // the hot state lives in locals for the slice and is stored back when it ends
+    uint64_t *sp = this->sp;
+    uint64_t *rp = this->rp;
+    size_t pc = this->pc;
+    const size_t count = tokens.size();
+    for (; budget && pc < count; --budget) {
+        const size_t ip = pc++;
+        // publish the op for the fault handler, a compiler barrier only
+        fault_ip = ip;
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        uint64_t a, b;
+        switch (tokens.types[ip]) {
             case TokenType::_INT:
-                data_stack.push_back(token.value);
+                *sp++ = tokens.values[ip];
             break;
             case TokenType::_CHR:
-                data_stack.push_back(token.value);
+                *sp++ = tokens.values[ip];
             break;
             case TokenType::_ADD:
-                b = pop(data_stack);
-                a = pop(data_stack);
-                data_stack.push_back(a + b);
+                b = *--sp;
+                sp[-1] += b;
             break;
             case TokenType::_SUB:
-                b = pop(data_stack);
-                a = pop(data_stack);
-                data_stack.push_back(a - b);
+                b = *--sp;
+                sp[-1] -= b;
             break;
             case TokenType::_MUL:
-                b = pop(data_stack);
-                a = pop(data_stack);
-                data_stack.push_back(a * b);
+                b = *--sp;
+                sp[-1] *= b;
             break;
             case TokenType::_DIV:
-                b = pop(data_stack);
-                a = pop(data_stack);
-                if (b == 0) { std::cerr << "Divide by zero! Location " << token.line << ":" << token.column << std::endl; exit(EXIT_FAILURE); }
-                data_stack.push_back(a / b);
+                // read the dividend first, a missing one faults as an underflow
+                b = *--sp;
+                a = *static_cast<volatile uint64_t*>(sp - 1);
+                if (b == 0) {
+                    fail(ip, "Divide by zero!");
+                    return state;
+                }
+                sp[-1] = a / b;
             break;
             case TokenType::_MOD:
-                b = pop(data_stack);
-                a = pop(data_stack);
-                if (b == 0) data_stack.push_back(a);
-                else data_stack.push_back(a % b);
-            break;
-            /*case TokenType::_RET:
-            // need to figure out how this works.
-                a = pop(data_stack);
-                std::cout << "Returned " << a << std::endl;
-            break;*/
+                // the dividend is read even when it is kept, see `/`
+                b = *--sp;
+                a = *static_cast<volatile uint64_t*>(sp - 1);
+                if (b != 0) sp[-1] = a % b;
+            break;
+            case TokenType::_PROC:
+                // definitions only run when called
+                pc = size_t(tokens.values[ip] + 1);
+            break;
             case TokenType::_IDN:
-                assert(false && "_IDN Not yet implemented...\n");
+                // call, the body starts after the proc's name
+                *rp++ = pc;
+                pc = size_t(tokens.values[ip] + 2);
             break;
-            case TokenType::_STR:
-                assert(false && "_STR Not yet implemented...\n");
-            /*// put characters onto stack in reverse and then put size of string
-                for (int i = token.value.size() - 1; i >= 0; --i) {
-                    data_stack.push_back(int(token.value[i]));
-                }
-                data_stack.push_back(int(token.value.size()));
-            */break;
-            case TokenType::_OUT:
-                a = pop(data_stack);
-                std::cout << a;
+            case TokenType::_RET:
+                pc = size_t(*--rp);
             break;
-            case TokenType::_PUT:
-                a = pop(data_stack);
-                std::cout << char(a);
+            case TokenType::_STR: {
+                // an offset into the string data, never a host pointer the program could forge
+                const StringRef &ref = tokens.strings[tokens.values[ip]];
+                sp[0] = ref.offset;
+                sp[1] = ref.length;
+                sp += 2;
+            } break;
+            case TokenType::_OUT: {
+                char digits[20];
+                char *d = digits + sizeof(digits);
+                a = *--sp;
+                do { *--d = char('0' + a % 10); a /= 10; } while (a);
+                output(d, size_t(digits + sizeof(digits) - d));
+            } break;
+            case TokenType::_PUT: {
+                const char c = char(*--sp);
+                output(&c, 1);
+            } break;
+            case TokenType::_PUTS:
+                b = *--sp;
+                a = *--sp;
+                if (a > tokens.string_data_size || b > tokens.string_data_size - a) {
+                    fail(ip, "Runtime Error: puts out of string bounds!");
+                    return state;
+                }
+                output(tokens.string_data + a, size_t(b));
             break;
             case TokenType::_DMP:
-                dumpStack(data_stack);
+                dumpStack(sp);
             break;
             case TokenType::_DUP:
                 // a b c -> a b c c
-                a = pop(data_stack);
-                data_stack.push_back(a);
-                data_stack.push_back(a);
+                sp[0] = sp[-1];
+                ++sp;
             break;
             case TokenType::_DUP2:
-                b = pop(data_stack);
-                a = pop(data_stack);
-                data_stack.push_back(a);
-                data_stack.push_back(b);
-                data_stack.push_back(a);
-                data_stack.push_back(b);
+                sp[0] = sp[-2];
+                sp[1] = sp[-1];
+                sp += 2;
             break;
             case TokenType::_ROT:
-                c = pop(data_stack);
-                b = pop(data_stack);
-                a = pop(data_stack);
-                data_stack.push_back(b);
-                data_stack.push_back(c);
-                data_stack.push_back(a);
+                // a b c -> b c a
+                a = sp[-3];
+                sp[-3] = sp[-2];
+                sp[-2] = sp[-1];
+                sp[-1] = a;
             break;
             case TokenType::_SWP:
-                b = pop(data_stack);
-                a = pop(data_stack);
-                data_stack.push_back(b);
-                data_stack.push_back(a);
+                a = sp[-2];
+                sp[-2] = sp[-1];
+                sp[-1] = a;
             break;
             case TokenType::_DROP:
-                pop(data_stack);
+                // the read is what faults on an empty stack
+                *static_cast<volatile uint64_t*>(--sp);
             break;
             case TokenType::_IF:
-                a = pop(data_stack);
-                if (a) continue;
-                else pc = size_t(token.value + 1);
+                a = *--sp;
+                if (profile) ++(a ? profile->counts[ip].then_count : profile->counts[ip].else_count);
+                if (!a) pc = size_t(tokens.values[ip] + 1);
             break;
             case TokenType::_ELSE:
-                pc = size_t(token.value + 1);
+                pc = size_t(tokens.values[ip] + 1);
             break;
             case TokenType::_END:
-                continue;
+                pc = size_t(tokens.values[ip]);
+            break;
+            case TokenType::_WHILE:
+            break;
+            case TokenType::_DO:
+                if (!*--sp) pc = size_t(tokens.values[ip] + 1);
             break;
             case TokenType::_GR:
-                b = pop(data_stack);
-                a = pop(data_stack);
-                data_stack.push_back(uint64_t(a > b));
+                b = *--sp;
+                sp[-1] = uint64_t(sp[-1] > b);
             break;
             case TokenType::_GE:
-                b = pop(data_stack);
-                a = pop(data_stack);
-                data_stack.push_back(uint64_t(a >= b));
+                b = *--sp;
+                sp[-1] = uint64_t(sp[-1] >= b);
             break;
             case TokenType::_EQ:
-                b = pop(data_stack);
-                a = pop(data_stack);
-                data_stack.push_back(uint64_t(a == b));
+                b = *--sp;
+                sp[-1] = uint64_t(sp[-1] == b);
             break;
             case TokenType::_LE:
-                b = pop(data_stack);
-                a = pop(data_stack);
-                data_stack.push_back(uint64_t(a <= b));
+                b = *--sp;
+                sp[-1] = uint64_t(sp[-1] <= b);
             break;
             case TokenType::_LT:
-                b = pop(data_stack);
-                a = pop(data_stack);
-                data_stack.push_back(uint64_t(a < b));
+                b = *--sp;
+                sp[-1] = uint64_t(sp[-1] < b);
             break;
             case TokenType::_NT:
-                b = pop(data_stack);
-                a = pop(data_stack);
-                data_stack.push_back(uint64_t(a != b));
+                b = *--sp;
+                sp[-1] = uint64_t(sp[-1] != b);
             break;
             case TokenType::_EOF:
-                return_val = pop(data_stack);
+                return_val = *--sp;
             break;
             case TokenType::_INV:
             default:
@@ -173,5 +299,25 @@ int interpret(const std::vector<Token> &tokens) {
             break;
         }
     }
-    return int(return_val);
+
+    fault_stack = nullptr;
+    fault_return_stack = nullptr;
+    this->sp = sp;
+    this->rp = rp;
+    this->pc = pc;
+    if (pc >= count) state = RunStatus::HALTED;
+    return state;
+}
+
+int interpret(const TokenView &tokens, BranchProfile *profile) {
+    Interpreter interpreter(tokens,
+        [](const char *data, size_t length) { std::cout.write(data, std::streamsize(length)); },
+        [](const std::string &message) {
+            std::cout.flush();
+            std::cerr << message << std::endl;
+            exit(EXIT_FAILURE);
+        },
+        profile);
+    while (interpreter.run(SIZE_MAX) == RunStatus::YIELDED) {}
+    return interpreter.returnValue();
 }
@@ -3,6 +3,7 @@
 #include <iostream>
 #include <sstream>
 #include <array>
+#include <unordered_map>
 #include <cassert>
 
 std::string escapeStr(std::string str) {
@@ -20,65 +21,55 @@ std::string escapeStr(std::string str) {
     return ss.str();
 }
 
-Token makeToken(TokenType type, int line, int column, uint64_t value = 0) {
-    Token t;
-    t.type = type;
-    t.line = line;
-    t.value = value;
-    switch (t.type) {
-        case TokenType::_INT: t.as_string = "INT"; break;
-        case TokenType::_CHR: t.as_string = "CHR"; break;
-        case TokenType::_STR: t.as_string = "STR"; break;
-        case TokenType::_IDN: t.as_string = "IDN"; break;
-        case TokenType::_ADD: t.as_string = "ADD"; break;
-        case TokenType::_SUB: t.as_string = "SUB"; break;
-        case TokenType::_MUL: t.as_string = "MUL"; break;
-        case TokenType::_DIV: t.as_string = "DIV"; break;
-        case TokenType::_MOD: t.as_string = "MOD"; break;
-       // case TokenType::_RET: t.as_string = "RET"; break;
-        case TokenType::_PUT: t.as_string = "PUT"; break;
-        case TokenType::_OUT: t.as_string = "OUT"; break;
-        case TokenType::_DUP2: t.as_string = "DUP2"; break;
-        case TokenType::_ROT: t.as_string = "ROT"; break;
-        case TokenType::_SWP: t.as_string = "SWP"; break;
-        case TokenType::_INV: t.as_string = "INV"; break;
-        case TokenType::_DMP: t.as_string = "DMP"; break;
-        case TokenType::_DUP: t.as_string = "DUP"; break;
-        case TokenType::_DROP: t.as_string = "DROP"; break;
-        case TokenType::_IF: t.as_string = "IF"; break;
-        case TokenType::_ELSE: t.as_string = "ELSE"; break;
-        case TokenType::_END: t.as_string = "END"; break;
-        case TokenType::_GR: t.as_string = "GR"; break;
-        case TokenType::_GE: t.as_string = "GE"; break;
-        case TokenType::_EQ: t.as_string = "EQ"; break;
-        case TokenType::_LE: t.as_string = "LE"; break;
-        case TokenType::_LT: t.as_string = "LT"; break;
-        case TokenType::_NT: t.as_string = "NT"; break;
-        case TokenType::_EOF: t.as_string = "EOF"; break;
-        default:
-            std::cerr << "Exhaustive handling of tokens in makeToken()" << std::endl;
-            exit(EXIT_FAILURE);
-        break;
-    }
-    return t;
-}
-
-std::vector<Token> tokenize(std::string src) {
+bool tokenize(const std::string &src, TokenStream &toks, std::string &error) {
     if (src.empty()) {
-        std::cerr << "empty file..." << std::endl;
-        exit(EXIT_FAILURE);
+        error = "empty file...";
+        return false;
     }
 
-    std::vector<Token> toks;
+    toks = TokenStream();
+    // Tokens are separated by whitespace, so the number of words is close to
+    // the token count. Reserving it up front keeps vector growth from doubling
+    // the peak size of large streams.
+    size_t words = 1; // EOF
+    bool in_word = false;
+    for (char c : src) {
+        const bool space = c == ' ' || c == '\n' || c == '\t';
+        if (!space && !in_word) ++words;
+        in_word = !space;
+    }
+    toks.reserve(words);
+    std::unordered_map<std::string, uint64_t> string_ids;
+    std::unordered_map<std::string, uint64_t> name_ids;
+
+    // identical literals share one entry in the string table
+    auto internString = [&](const std::string &str) {
+        auto it = string_ids.find(str);
+        if (it == string_ids.end()) {
+            it = string_ids.emplace(str, toks.strings.size()).first;
+            toks.strings.push_back(StringRef{toks.string_data.size(), str.size()});
+            toks.string_data += str;
+        }
+        return it->second;
+    };
+    // names are kept apart, only literals end up in the program's data
+    auto internName = [&](const std::string &name) {
+        auto it = name_ids.find(name);
+        if (it == name_ids.end()) {
+            it = name_ids.emplace(name, toks.names.size()).first;
+            toks.names.push_back(name);
+        }
+        return it->second;
+    };
     int line = 0;
-    int column = 0;
+    size_t line_start = 0;  // index of the first character of the line, columns count from 1 as editors do
 
-    assert((TokenType::_COUNT == 28) && "Exhaustive handling of tokens in tokenize()");
+    assert((TokenType::_COUNT == 33) && "Exhaustive handling of tokens in tokenize()");
     for (size_t i = 0; i < src.size(); ++i) {
         // new line, increment line number
         if (src[i] == '\n') {
             ++line;
-            column = 0;
+            line_start = i + 1;
             continue;
         }
         
@@ -93,24 +84,26 @@ std::vector<Token> tokenize(std::string src) {
         }
 
         // skip whitespace
-        if (src[i] == ' ' || src[i] == '\t') { ++column; continue; }
+        if (src[i] == ' ' || src[i] == '\t') continue;
+
+        const int column = int(i - line_start) + 1;
 
         // Math and conditions
-             if (src[i] == '+') toks.push_back(makeToken(TokenType::_ADD, line, column));
-        else if (src[i] == '-') toks.push_back(makeToken(TokenType::_SUB, line, column));
-        else if (src[i] == '*') toks.push_back(makeToken(TokenType::_MUL, line, column));
-        else if (src[i] == '/') toks.push_back(makeToken(TokenType::_DIV, line, column));
-        else if (src[i] == '%') toks.push_back(makeToken(TokenType::_MOD, line, column));
+             if (src[i] == '+') toks.push(TokenType::_ADD, line, column);
+        else if (src[i] == '-') toks.push(TokenType::_SUB, line, column);
+        else if (src[i] == '*') toks.push(TokenType::_MUL, line, column);
+        else if (src[i] == '/') toks.push(TokenType::_DIV, line, column);
+        else if (src[i] == '%') toks.push(TokenType::_MOD, line, column);
         else if (src[i] == '>') {
-            if (i+1 < src.size() && src[i+1] == '=') { toks.push_back(makeToken(TokenType::_GE, line, column)); ++i; }
-            else toks.push_back(makeToken(TokenType::_GR, line, column));
+            if (i+1 < src.size() && src[i+1] == '=') { toks.push(TokenType::_GE, line, column); ++i; }
+            else toks.push(TokenType::_GR, line, column);
         }
         else if (src[i] == '<') {
-            if (i+1 < src.size() && src[i+1] == '=') { toks.push_back(makeToken(TokenType::_LE, line, column)); ++i; }
-            else toks.push_back(makeToken(TokenType::_LT, line, column));
+            if (i+1 < src.size() && src[i+1] == '=') { toks.push(TokenType::_LE, line, column); ++i; }
+            else toks.push(TokenType::_LT, line, column);
         }
-        else if (src[i] == '=') toks.push_back(makeToken(TokenType::_EQ, line, column));
-        else if (src[i] == '!') toks.push_back(makeToken(TokenType::_NT, line, column));
+        else if (src[i] == '=') toks.push(TokenType::_EQ, line, column);
+        else if (src[i] == '!') toks.push(TokenType::_NT, line, column);
 
         // digit encountered
         // TODO: Figure out floats
@@ -131,55 +124,63 @@ std::vector<Token> tokenize(std::string src) {
                     break;
             }
             if (invalid)
-                toks.push_back(makeToken(TokenType::_INV, line, column));
+                toks.push(TokenType::_INV, line, column);
             else
-                toks.push_back(makeToken(TokenType::_INT, line, column, std::stoull(value)));
+                toks.push(TokenType::_INT, line, column, std::stoull(value));
         }
 
         // string
-        /*else if (src[i] == '"') {
+        else if (src[i] == '"') {
+            const int start_line = line;
             ++i;
             std::string str;
-            while (src[i] != '"') {
+            while (true) {
+                if (i >= src.size()) {
+                    // eof reached, unclosed string
+                    error = "Error: EOF reached, unclosed string line: " + std::to_string(start_line);
+                    return false;
+                }
+                if (src[i] == '"') break;
                 if (src[i] == '\\') {
                     ++i;
+                    if (i >= src.size()) continue;
                     if (src[i] == 'n') str += '\n';
                     else if (src[i] == 't') str += '\t';
+                    else if (src[i] == 'r') str += '\r';
+                    else if (src[i] == '0') str += '\0';
                     else if (src[i] == '\\') str += '\\';
                     else if (src[i] == '"') str += '"';
                     else {
-                        // TODO: Better error handling here
-                        std::cout << "Unknown escape sequence: " << src[i-1] << src[i] << std::endl;
-                        exit(EXIT_FAILURE);
+                        error = std::string("Error: unknown escape sequence: \\") + src[i] + " line: " + std::to_string(line);
+                        return false;
                     }
-                    ++i;
                 }
-                else str += src[i++];
-
-                if (i >= src.size()) {
-                    // eof reached, unclosed string
-                    // TODO: Better error handling here (give line?)
-                    std::cerr << "EOF Reached, Unclosed string!\n";
-                    exit(EXIT_FAILURE);
+                else {
+                    if (src[i] == '\n') {
+                        ++line;
+                        line_start = i + 1;
+                    }
+                    str += src[i];
                 }
+                ++i;
             }
 
-            toks.push_back(makeToken(TokenType::_STR, line, str));
-        }*/
+            toks.push(TokenType::_STR, start_line, column, internString(str));
+        }
         
         // char
         // TODO: Does not handle escaped characters (though you can just push an int and call `put` to treat it as char)
         else if (src[i] == '\'') {
             if (i+2 >= src.size()) {
-                std::cerr << "Error: Unclosed char at EOF\n";
-                exit(EXIT_FAILURE);
+                error = "Error: Unclosed char at EOF";
+                return false;
             }
             else if (src[i+2] != '\'') {
-                std::cerr << "Error: char definition must be pattern 'x' line: " << line << "\n";
-                exit(EXIT_FAILURE);
+                error = "Error: char definition must be pattern 'x' line: " + std::to_string(line);
+                return false;
             }
             else {
-                toks.push_back(makeToken(TokenType::_CHR, line, column, uint64_t(src[i+1])));
+                toks.push(TokenType::_CHR, line, column, uint64_t(src[i+1]));
             }
             i+=3;
         }
@@ -193,39 +194,53 @@ std::vector<Token> tokenize(std::string src) {
             }
             --i;
             // check for keywords
-            //if (ident == "ret")         toks.push_back(makeToken(TokenType::_RET, line, column));
-                 if (ident == "out")    toks.push_back(makeToken(TokenType::_OUT,  line, column));
-            else if (ident == "put")    toks.push_back(makeToken(TokenType::_PUT,  line, column));
-            else if (ident == "dump")   toks.push_back(makeToken(TokenType::_DMP,  line, column));
-            else if (ident == "dup")    toks.push_back(makeToken(TokenType::_DUP,  line, column));
-            else if (ident == "dup2")   toks.push_back(makeToken(TokenType::_DUP2, line, column));
-            else if (ident == "rot")    toks.push_back(makeToken(TokenType::_ROT,  line, column));
-            else if (ident == "swap")   toks.push_back(makeToken(TokenType::_SWP,  line, column));
-            else if (ident == "drop")   toks.push_back(makeToken(TokenType::_DROP, line, column));
-            else if (ident == "if")     toks.push_back(makeToken(TokenType::_IF,   line, column));
-            else if (ident == "else")  toks.push_back(makeToken(TokenType::_ELSE, line, column));
-            else if (ident == "end")    toks.push_back(makeToken(TokenType::_END,  line, column));
-            else                        toks.push_back(makeToken(TokenType::_IDN,  line, column));
+                 if (ident == "out")    toks.push(TokenType::_OUT,  line, column);
+            else if (ident == "put")    toks.push(TokenType::_PUT,  line, column);
+            else if (ident == "puts")   toks.push(TokenType::_PUTS, line, column);
+            else if (ident == "dump")   toks.push(TokenType::_DMP,  line, column);
+            else if (ident == "dup")    toks.push(TokenType::_DUP,  line, column);
+            else if (ident == "dup2")   toks.push(TokenType::_DUP2, line, column);
+            else if (ident == "rot")    toks.push(TokenType::_ROT,  line, column);
+            else if (ident == "swap")   toks.push(TokenType::_SWP,  line, column);
+            else if (ident == "drop")   toks.push(TokenType::_DROP, line, column);
+            else if (ident == "if")     toks.push(TokenType::_IF,   line, column);
+            else if (ident == "else")  toks.push(TokenType::_ELSE, line, column);
+            else if (ident == "end")    toks.push(TokenType::_END,  line, column);
+            else if (ident == "while")  toks.push(TokenType::_WHILE, line, column);
+            else if (ident == "do")     toks.push(TokenType::_DO,   line, column);
+            else if (ident == "proc")   toks.push(TokenType::_PROC, line, column);
+            else                        toks.push(TokenType::_IDN,  line, column, internName(ident));
         }
-    ++column;
     }
 
-    toks.push_back(Token{TokenType::_EOF, line, column});
+    toks.push(TokenType::_EOF, line, int(src.size() - line_start) + 1);
 
-    return toks;
+    return true;
 }
 
-void printTokens(const std::vector<Token> &toks) {
-    for (const auto &t : toks) {
-        switch (t.type) {
+void printTokens(const TokenStream &toks) {
+    for (size_t i = 0; i < toks.size(); ++i) {
+        uint32_t line = toks.locations[i].line;
+        switch (toks.types[i]) {
             case TokenType::_INT:
-                std::cout << t.line << "    " << t.as_string << " - value: " << t.value << "\n";
+                std::cout << line << "    " << tokenName(toks.types[i]) << " - value: " << toks.values[i] << "\n";
             break;
             case TokenType::_CHR:
-                std::cout << t.line << "    " << t.as_string << " - value: " << char(t.value) << "\n";
+                std::cout << line << "    " << tokenName(toks.types[i]) << " - value: " << char(toks.values[i]) << "\n";
+            break;
+            case TokenType::_IDN:
+                std::cout << line << "    " << tokenName(toks.types[i]) << " - value: " << toks.name(i) << "\n";
+            break;
+            case TokenType::_STR: {
+                const StringRef &ref = toks.strings[toks.values[i]];
+                std::cout << line << "    " << tokenName(toks.types[i]) << " - value: \"" << escapeStr(toks.string_data.substr(ref.offset, ref.length)) << "\"\n";
+            } break;
+            case TokenType::_EOF:
+                // the EOF token never carried a display name, keep -d output unchanged
+                std::cout << line << "    " << "\n";
             break;
             default:
-                std::cout << t.line << "    " << t.as_string << "\n";
+                std::cout << line << "    " << tokenName(toks.types[i]) << "\n";
             break;
         }
     }
@@ -0,0 +1,115 @@
+#include "optimizer.hpp"
+
+#include <unordered_map>
+
+// bodies up to this many tokens are inlined at every call site
+constexpr size_t inline_max_tokens = 16;
+// a leaf only appears once its callees are inlined, bounds the rounds for call chains
+constexpr int inline_max_rounds = 8;
+
+struct ProcInfo {
+    size_t proc_pc;     // `proc` token, the name follows it
+    size_t end_pc;      // its closing `end`
+    size_t calls = 0;
+    bool leaf = true;   // body calls nothing
+};
+
+// procedures by name (string index), false when the block structure does not allow inlining
+bool collectProcs(const TokenStream &tokens, std::unordered_map<uint64_t, ProcInfo> &procs) {
+    std::vector<size_t> open_procs;
+    int depth = 0;
+    for (size_t pc = 0; pc < tokens.size(); ++pc) {
+        switch (tokens.types[pc]) {
+            case TokenType::_PROC:
+                if (depth != 0 || tokens.types[pc + 1] != TokenType::_IDN) return false;
+                if (procs.count(tokens.values[pc + 1])) return false;
+                procs[tokens.values[pc + 1]] = ProcInfo{pc, 0};
+                open_procs.push_back(pc);
+                ++depth;
+                ++pc; // the name is not a call
+            break;
+            case TokenType::_IF:
+            case TokenType::_WHILE:
+                ++depth;
+            break;
+            case TokenType::_END:
+                if (--depth < 0) return false;
+                if (depth == 0 && !open_procs.empty()) {
+                    procs[tokens.values[open_procs.back() + 1]].end_pc = pc;
+                    open_procs.pop_back();
+                }
+            break;
+            case TokenType::_IDN: {
+                if (!open_procs.empty()) procs[tokens.values[open_procs.back() + 1]].leaf = false;
+            } break;
+            default:
+            break;
+        }
+    }
+    if (depth != 0) return false;
+
+    for (size_t pc = 0; pc < tokens.size(); ++pc) {
+        if (tokens.types[pc] == TokenType::_PROC) ++pc;
+        else if (tokens.types[pc] == TokenType::_IDN) {
+            auto it = procs.find(tokens.values[pc]);
+            if (it != procs.end()) ++it->second.calls;
+        }
+    }
+    return true;
+}
+
+InlineStats inlineProcs(TokenStream &tokens) {
+    InlineStats stats;
+    stats.tokens_before = tokens.size();
+
+    for (int round = 0; round < inline_max_rounds; ++round) {
+        std::unordered_map<uint64_t, ProcInfo> procs;
+        if (!collectProcs(tokens, procs)) break;
+
+        auto inlinable = [&](const ProcInfo &p) {
+            const size_t body = p.end_pc - p.proc_pc - 2;
+            return p.leaf && p.calls > 0 && (body <= inline_max_tokens || p.calls == 1);
+        };
+        bool changed = false;
+        for (const auto &entry : procs) {
+            if (inlinable(entry.second) || entry.second.calls == 0) changed = true;
+        }
+        if (!changed) break;
+
+        TokenStream out;
+        out.strings = std::move(tokens.strings);
+        out.string_data = std::move(tokens.string_data);
+        out.names = std::move(tokens.names);
+        auto copy = [&](size_t pc) {
+            out.types.push_back(tokens.types[pc]);
+            out.values.push_back(tokens.values[pc]);
+            out.locations.push_back(tokens.locations[pc]);
+        };
+
+        for (size_t pc = 0; pc < tokens.size(); ++pc) {
+            if (tokens.types[pc] == TokenType::_PROC) {
+                const ProcInfo &p = procs[tokens.values[pc + 1]];
+                // definitions of inlined and uncalled procedures go away
+                if (inlinable(p) || p.calls == 0) {
+                    ++stats.procs_removed;
+                    pc = p.end_pc;
+                    continue;
+                }
+                copy(pc++); // and its name
+            }
+            else if (tokens.types[pc] == TokenType::_IDN) {
+                auto it = procs.find(tokens.values[pc]);
+                if (it != procs.end() && inlinable(it->second)) {
+                    for (size_t b = it->second.proc_pc + 2; b < it->second.end_pc; ++b) copy(b);
+                    ++stats.calls_inlined;
+                    continue;
+                }
+            }
+            copy(pc);
+        }
+        tokens = std::move(out);
+    }
+
+    stats.tokens_after = tokens.size();
+    return stats;
+}
@@ -0,0 +1,70 @@
+#include "profile.hpp"
+
+#include <iostream>
+#include <fstream>
+
+// text format:
+//   glomp-profile <version> <token count>
+//   <token index> <then count> <else count>     one line per executed `if`
+constexpr int profile_version = 1;
+
+// an arm taken at most this often is cold, in between the branch is unpredictable
+constexpr double cold_ratio = 0.2;
+
+BranchLayout branchLayout(const BranchProfile *profile, size_t pc) {
+    if (!profile) return BranchLayout::DEFAULT;
+    const BranchCounts &c = profile->counts[pc];
+    const uint64_t total = c.then_count + c.else_count;
+    if (total == 0) return BranchLayout::DEFAULT;
+
+    const double then_ratio = double(c.then_count) / double(total);
+    if (then_ratio <= cold_ratio) return BranchLayout::COLD_THEN;
+    if (then_ratio >= 1.0 - cold_ratio) return BranchLayout::COLD_ELSE;
+    return BranchLayout::SELECT;
+}
+
+void writeProfile(const BranchProfile &profile, std::string path) {
+    std::ofstream out_file(path, std::ofstream::trunc | std::ofstream::out);
+    if (!out_file.is_open()) {
+        std::cerr << "unable to create file: " << path << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    out_file << "glomp-profile " << profile_version << " " << profile.counts.size() << "\n";
+    for (size_t pc = 0; pc < profile.counts.size(); ++pc) {
+        const BranchCounts &c = profile.counts[pc];
+        if (c.then_count || c.else_count) out_file << pc << " " << c.then_count << " " << c.else_count << "\n";
+    }
+}
+
+bool readProfile(std::string path, size_t token_count, BranchProfile &profile) {
+    std::ifstream in_file(path);
+    if (!in_file.is_open()) {
+        std::cerr << "Failed to open file: " << path << std::endl;
+        return false;
+    }
+
+    std::string magic;
+    int version = 0;
+    size_t count = 0;
+    in_file >> magic >> version >> count;
+    if (magic != "glomp-profile" || version != profile_version) {
+        std::cerr << path << ": not a glomp profile" << std::endl;
+        return false;
+    }
+    if (count != token_count) {
+        std::cerr << path << ": profile is for a different program (" << count << " tokens, expected " << token_count << ")" << std::endl;
+        return false;
+    }
+
+    profile = BranchProfile(token_count);
+    size_t pc;
+    BranchCounts c;
+    while (in_file >> pc >> c.then_count >> c.else_count) {
+        if (pc >= token_count) {
+            std::cerr << path << ": token index out of range: " << pc << std::endl;
+            return false;
+        }
+        profile.counts[pc] = c;
+    }
+    return true;
+}